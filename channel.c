@@ -0,0 +1,496 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "emulator.h"
+#include "channel.h"
+
+/* ******************************************************************
+   Channel models used by tolayer3() in place of the independent
+   Bernoulli loss and corruption trials.
+
+   Gilbert-Elliott: a two state Markov chain per direction.  Every packet
+   first moves the chain (GOOD->BAD with p_gb, BAD->GOOD with p_bg), then
+   is lost or corrupted with the probabilities of the state it is in.
+   The mean time spent in BAD is 1/p_bg packets, so losses arrive in
+   bursts rather than independently.
+
+   Bottleneck link: a packet waits in a FIFO until the link is free, takes
+   sizeof(struct pkt)/bandwidth to serialize and then the propagation
+   delay to arrive.  A full FIFO tail-drops; with RED enabled packets are
+   also dropped early with a probability that grows with the average
+   queue length.
+
+   Bit errors: every bit of a packet (header and payload alike) is
+   flipped independently with the bit error rate, so longer packets are
+   hit more often and several bits can go at once.  Instead of a trial
+   per bit, the number of error-free bits up to the next error is drawn
+   from the geometric distribution and carried over from packet to
+   packet; a packet that ends before the next error costs a subtraction.
+
+   Reordering: a packet held back gets extra delay and no longer stacks
+   the packets behind it, so they overtake it.  Its reorder depth is how
+   many packets that entered the medium after it arrived before it.
+
+   Every model keeps its state per channel: one per path and direction,
+   numbered path*2 + sending entity.  Flows that share a path share its
+   queue, loss state and statistics.  The parameters are the same for
+   every path.
+**********************************************************************/
+
+#define GOOD 0
+#define BAD  1
+
+#define BURSTBINS 7   /* burst length histogram: 1, 2, 3-4, 5-8, 9-16, 17-32, >32 */
+
+struct gilbert {
+  int enabled;
+  double p_gb;          /* probability of GOOD -> BAD per packet */
+  double p_bg;          /* probability of BAD -> GOOD per packet */
+  double loss[2];       /* loss probability in each state */
+  double corrupt[2];    /* corruption probability in each state */
+};
+
+struct lossbursts {
+  long packets;         /* packets offered to the channel */
+  long lost;
+  long run;             /* length of the burst in progress */
+  long bursts;
+  long maxburst;
+  long hist[BURSTBINS];
+};
+
+struct link {
+  double *finish;       /* FIFO of transmission finish times (ring) */
+  int head, count;
+  double busyuntil;     /* time the last queued packet finishes */
+  double avgq;          /* RED average queue length */
+  double busytime;      /* total time spent transmitting */
+  double queuedelay;    /* total time spent waiting for the link */
+  long packets;         /* packets offered to the link */
+  long taildrops;
+  long reddrops;
+  int maxq;
+};
+
+#define DEPTHBINS 6   /* reorder depth histogram: 1, 2, 3-4, 5-8, 9-16, >16 */
+
+struct reordering {
+  long sent;            /* packets that entered the medium */
+  long maxarrived;      /* highest send order that has arrived */
+  long arrivals;
+  long late;            /* arrivals overtaken by later packets */
+  long depthsum;
+  long maxdepth;
+  long hist[DEPTHBINS];
+  long held;            /* packets held back */
+  long duplicated;      /* second copies delivered */
+};
+
+/* state of one path in one direction */
+struct channel {
+  int gestate;          /* Gilbert-Elliott GOOD or BAD */
+  long gepackets[2];    /* packets sent while in each state */
+  struct lossbursts bursts;
+  struct link link;
+  struct reordering reorder;
+  double bergap;        /* error-free bits before the next bit error, -1 not drawn */
+  long berpackets;      /* packets offered to the bit error model */
+  long bercorrupted;    /* of them with at least one bit flipped */
+  long berbits;         /* bits flipped */
+};
+
+static struct gilbert ge[2];        /* parameters per direction */
+static struct channel *chans;
+static int npaths = 1;
+
+static int linkon = 0;
+static double bandwidth;     /* bytes per time unit */
+static double propdelay;     /* time units */
+static int qlimit;           /* packets */
+static int redon = 0;
+static double red_min, red_max, red_maxp, red_weight;
+static double reorderprob = 0.0;
+static double maxholdback;
+static double dupprob = 0.0;
+static double ber = 0.0;     /* bit error rate, 0 off */
+
+static const char *dirname[2] = { "A->B", "B->A" };
+
+
+int channel_init(int paths)
+{
+  int c;
+
+  npaths = paths;
+  chans = calloc(2 * npaths, sizeof(struct channel));
+  if (chans == 0) {
+    printf("memory allocation for channels failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (c=0; c<2*npaths && linkon; c++) {
+    chans[c].link.finish = malloc(qlimit * sizeof(double));
+    if (chans[c].link.finish == 0) {
+      printf("memory allocation for link queue failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (c=0; c<2*npaths; c++)
+    chans[c].bergap = -1.0;
+  return 2 * npaths;
+}
+
+
+/********* Gilbert-Elliott model ************/
+
+int ge_configure(int direction, const char *spec)
+{
+  struct gilbert *g = &ge[direction];
+  int n, i;
+
+  g->corrupt[GOOD] = 0.0;
+  g->corrupt[BAD] = 0.0;
+  n = sscanf(spec, "%lf,%lf,%lf,%lf,%lf,%lf", &g->p_gb, &g->p_bg, &g->loss[GOOD],
+             &g->loss[BAD], &g->corrupt[GOOD], &g->corrupt[BAD]);
+  if (n != 4 && n != 6)
+    return 0;
+  if (g->p_gb < 0.0 || g->p_gb > 1.0 || g->p_bg <= 0.0 || g->p_bg > 1.0)
+    return 0;
+  for (i=GOOD; i<=BAD; i++)
+    if (g->loss[i] < 0.0 || g->loss[i] > 1.0 || g->corrupt[i] < 0.0 || g->corrupt[i] > 1.0)
+      return 0;
+  g->enabled = 1;
+  return 1;
+}
+
+int ge_enabled(int channel)
+{
+  return ge[channel % 2].enabled;
+}
+
+int ge_lost(int channel)
+{
+  struct gilbert *g = &ge[channel % 2];
+  struct channel *c = &chans[channel];
+
+  if (c->gestate == GOOD) {
+    if (jimsrand() < g->p_gb)
+      c->gestate = BAD;
+  }
+  else if (jimsrand() < g->p_bg)
+    c->gestate = GOOD;
+  c->gepackets[c->gestate]++;
+  return jimsrand() < g->loss[c->gestate];
+}
+
+int ge_corrupt(int channel)
+{
+  return jimsrand() < ge[channel % 2].corrupt[chans[channel].gestate];
+}
+
+
+/********* bit errors ************/
+
+int ber_configure(const char *spec)
+{
+  if (sscanf(spec, "%lf", &ber) != 1)
+    return 0;
+  return ber > 0.0 && ber <= 1.0;
+}
+
+int ber_enabled(void)
+{
+  return ber > 0.0;
+}
+
+/* error-free bits before the next error: geometric with success ber */
+static double bergap(void)
+{
+  double u;
+
+  if (ber >= 1.0)
+    return 0.0;
+  do
+    u = jimsrand();
+  while (u <= 0.0);
+  return floor(log(u) / log(1.0 - ber));
+}
+
+int ber_corrupt(int channel, struct pkt *packet)
+{
+  struct channel *c = &chans[channel];
+  unsigned char *bits = (unsigned char *)packet;
+  double nbits = 8.0 * sizeof(struct pkt), pos;
+  int flipped = 0;
+  long bit;
+
+  c->berpackets++;
+  if (c->bergap < 0.0)
+    c->bergap = bergap();
+  for (pos = c->bergap; pos < nbits; pos += 1.0 + bergap()) {
+    bit = (long)pos;
+    bits[bit / 8] ^= (unsigned char)(1 << (bit % 8));
+    flipped++;
+  }
+  c->bergap = pos - nbits;
+  if (flipped > 0) {
+    c->bercorrupted++;
+    c->berbits += flipped;
+  }
+  return flipped;
+}
+
+
+/********* bottleneck link ************/
+
+int link_configure(const char *spec)
+{
+  if (sscanf(spec, "%lf,%lf,%d", &bandwidth, &propdelay, &qlimit) != 3)
+    return 0;
+  if (bandwidth <= 0.0 || propdelay < 0.0 || qlimit < 1)
+    return 0;
+  linkon = 1;
+  return 1;
+}
+
+int red_configure(const char *spec)
+{
+  red_weight = 0.002;
+  if (sscanf(spec, "%lf,%lf,%lf,%lf", &red_min, &red_max, &red_maxp, &red_weight) < 3)
+    return 0;
+  if (red_min < 0.0 || red_max <= red_min || red_maxp <= 0.0 || red_maxp > 1.0 ||
+      red_weight <= 0.0 || red_weight > 1.0)
+    return 0;
+  redon = 1;
+  return 1;
+}
+
+int link_enabled(void)
+{
+  return linkon;
+}
+
+double link_send(int channel, double now)
+{
+  struct link *l = &chans[channel].link;
+  double start, txtime;
+
+  l->packets++;
+
+  /* packets that finished transmitting have left the queue */
+  while (l->count > 0 && l->finish[l->head] <= now) {
+    l->head = (l->head + 1) % qlimit;
+    l->count--;
+  }
+
+  if (redon) {
+    l->avgq = (1.0 - red_weight) * l->avgq + red_weight * l->count;
+    if (l->avgq >= red_max ||
+        (l->avgq > red_min && jimsrand() < red_maxp * (l->avgq - red_min) / (red_max - red_min))) {
+      l->reddrops++;
+      return -1.0;
+    }
+  }
+  if (l->count == qlimit) {
+    l->taildrops++;
+    return -1.0;
+  }
+
+  txtime = sizeof(struct pkt) / bandwidth;
+  start = (l->busyuntil > now) ? l->busyuntil : now;
+  l->busyuntil = start + txtime;
+  l->finish[(l->head + l->count) % qlimit] = l->busyuntil;
+  l->count++;
+  if (l->count > l->maxq)
+    l->maxq = l->count;
+  l->busytime += txtime;
+  l->queuedelay += start - now;
+  return l->busyuntil + propdelay;
+}
+
+
+/* fraction of the time up to now the link spent transmitting */
+double link_utilization(int channel, double now)
+{
+  return now > 0.0 ? chans[channel].link.busytime / now : 0.0;
+}
+
+/* least time any packet spends in the medium: the lookahead of a
+   partition, nothing it sends can arrive sooner */
+double channel_lookahead(void)
+{
+  if (linkon)
+    return sizeof(struct pkt) / bandwidth + propdelay;
+  return 1.0;
+}
+
+/********* reordering and duplication ************/
+
+int reorder_configure(const char *spec)
+{
+  if (sscanf(spec, "%lf,%lf", &reorderprob, &maxholdback) != 2)
+    return 0;
+  return reorderprob >= 0.0 && reorderprob <= 1.0 && maxholdback > 0.0;
+}
+
+int duplicate_configure(const char *spec)
+{
+  if (sscanf(spec, "%lf", &dupprob) != 1)
+    return 0;
+  return dupprob >= 0.0 && dupprob <= 1.0;
+}
+
+double reorder_delay(int channel)
+{
+  if (reorderprob <= 0.0 || jimsrand() >= reorderprob)
+    return 0.0;
+  chans[channel].reorder.held++;
+  return maxholdback * jimsrand() + 1e-3;   /* never exactly zero */
+}
+
+int duplicate(int channel)
+{
+  if (dupprob <= 0.0 || jimsrand() >= dupprob)
+    return 0;
+  chans[channel].reorder.duplicated++;
+  return 1;
+}
+
+long channel_sendseq(int channel)
+{
+  return chans[channel].reorder.sent++;
+}
+
+void channel_count_arrival(int channel, long sendseq)
+{
+  struct reordering *r = &chans[channel].reorder;
+  long depth;
+  int bin;
+
+  r->arrivals++;
+  if (r->arrivals == 1 || sendseq > r->maxarrived) {
+    r->maxarrived = sendseq;
+    return;
+  }
+  depth = r->maxarrived - sendseq;
+  r->late++;
+  r->depthsum += depth;
+  if (depth > r->maxdepth)
+    r->maxdepth = depth;
+  for (bin = 0, depth--; depth > 0 && bin < DEPTHBINS - 1; depth >>= 1)
+    bin++;
+  r->hist[bin]++;
+}
+
+
+/********* statistics ************/
+
+static void end_burst(struct lossbursts *b)
+{
+  int bin;
+  long len;
+
+  if (b->run == 0)
+    return;
+  for (bin = 0, len = b->run - 1; len > 0 && bin < BURSTBINS - 1; len >>= 1)
+    bin++;
+  b->hist[bin]++;
+  b->bursts++;
+  if (b->run > b->maxburst)
+    b->maxburst = b->run;
+  b->run = 0;
+}
+
+void channel_count_loss(int channel, int lost)
+{
+  struct lossbursts *b = &chans[channel].bursts;
+
+  b->packets++;
+  if (lost) {
+    b->lost++;
+    b->run++;
+  }
+  else
+    end_burst(b);
+}
+
+/* "A->B", or "path 3 A->B" when there is more than one path */
+static const char *channel_name(int channel)
+{
+  static char name[32];
+
+  if (npaths > 1)
+    sprintf(name, "path %d %s", channel / 2, dirname[channel % 2]);
+  else
+    sprintf(name, "%s", dirname[channel % 2]);
+  return name;
+}
+
+void channel_report(double now)
+{
+  static const char *binname[BURSTBINS] = { "1", "2", "3-4", "5-8", "9-16", "17-32", ">32" };
+  static const char *depthname[DEPTHBINS] = { "1", "2", "3-4", "5-8", "9-16", ">16" };
+  struct gilbert *g;
+  struct channel *c;
+  struct lossbursts *b;
+  struct link *l;
+  struct reordering *r;
+  long admitted, nheld = 0, nduplicated = 0;
+  int d, i;
+
+  if (reorderprob > 0.0 || dupprob > 0.0) {
+    for (d=0; d<2*npaths; d++) {
+      nheld += chans[d].reorder.held;
+      nduplicated += chans[d].reorder.duplicated;
+    }
+    printf("reordering channel: %ld packets held back, %ld duplicated\n", nheld, nduplicated);
+    for (d=0; d<2*npaths; d++) {
+      r = &chans[d].reorder;
+      printf("  %s: %ld of %ld arrivals out of order, mean depth %.2f, max depth %ld, depths:", channel_name(d),
+             r->late, r->arrivals, r->late ? (double)r->depthsum / r->late : 0.0, r->maxdepth);
+      for (i=0; i<DEPTHBINS; i++)
+        printf(" %s:%ld", depthname[i], r->hist[i]);
+      printf("\n");
+    }
+  }
+  if (ber > 0.0) {
+    printf("bit error channel: rate %g, %.2f expected bit errors per packet\n", ber, ber * 8.0 * sizeof(struct pkt));
+    for (d=0; d<2*npaths; d++) {
+      c = &chans[d];
+      printf("  %s: %ld of %ld packets corrupted, %ld bit errors, %.2f per corrupted packet\n", channel_name(d),
+             c->bercorrupted, c->berpackets, c->berbits,
+             c->bercorrupted ? (double)c->berbits / c->bercorrupted : 0.0);
+    }
+  }
+  if (linkon) {
+    printf("bottleneck link: bandwidth %.3f bytes/time, delay %.3f, queue %d packets%s\n",
+           bandwidth, propdelay, qlimit, redon ? ", RED" : ", tail drop");
+    printf("  bandwidth-delay product:  %.2f packets\n",
+           bandwidth * (2.0 * propdelay + sizeof(struct pkt) / bandwidth) / sizeof(struct pkt));
+    for (d=0; d<2*npaths; d++) {
+      l = &chans[d].link;
+      admitted = l->packets - l->taildrops - l->reddrops;
+      printf("  %s: %ld packets, %ld tail drops, %ld RED drops, max queue %d, mean queueing delay %.3f, utilization %.1f%%\n",
+             channel_name(d), l->packets, l->taildrops, l->reddrops, l->maxq,
+             admitted ? l->queuedelay / admitted : 0.0, now > 0.0 ? 100.0 * l->busytime / now : 0.0);
+    }
+  }
+
+  for (d=0; d<2*npaths; d++) {
+    g = &ge[d % 2];
+    c = &chans[d];
+    b = &c->bursts;
+    if (!g->enabled)
+      continue;
+    end_burst(b);
+    printf("Gilbert-Elliott channel %s: p_gb %.4f p_bg %.4f, loss %.4f/%.4f, corruption %.4f/%.4f (good/bad)\n",
+           channel_name(d), g->p_gb, g->p_bg, g->loss[GOOD], g->loss[BAD], g->corrupt[GOOD], g->corrupt[BAD]);
+    printf("  packets in bad state:  %ld of %ld, expected bad period %.2f packets\n",
+           c->gepackets[BAD], c->gepackets[GOOD] + c->gepackets[BAD], 1.0 / g->p_bg);
+    printf("  packets lost:  %ld in %ld bursts, mean burst %.2f, max burst %ld\n", b->lost,
+           b->bursts, b->bursts ? (double)b->lost / b->bursts : 0.0, b->maxburst);
+    printf("  burst lengths: ");
+    for (i=0; i<BURSTBINS; i++)
+      printf(" %s:%ld", binname[i], b->hist[i]);
+    printf("\n");
+  }
+}
@@ -0,0 +1,63 @@
+/* channel directions, indexed by the sending entity */
+#define AtoB 0
+#define BtoA 1
+
+/* A channel is one direction of one path: path*2 + sending entity.
+   Allocate the channels for npaths once the options are parsed; returns
+   the number of channels. */
+extern int channel_init(int npaths);
+
+/* random number in [0,1], from the emulator */
+extern double jimsrand(void);
+
+/* Gilbert-Elliott two state loss/corruption model.  spec is
+   "p_gb,p_bg,loss_good,loss_bad[,corrupt_good,corrupt_bad]", returns 0 if
+   it cannot be parsed or a probability is outside [0,1] */
+extern int ge_configure(int direction, const char *spec);
+extern int ge_enabled(int channel);
+extern int ge_lost(int channel);      /* advances the state, then draws loss */
+extern int ge_corrupt(int channel);   /* draws corruption in the current state */
+
+/* Bit errors: every bit of a packet is flipped with probability rate.
+   spec is "rate".  ber_corrupt() flips the bits of packet the channel
+   hits and returns how many, 0 for most packets at low rates. */
+extern int ber_configure(const char *spec);
+extern int ber_enabled(void);
+extern int ber_corrupt(int channel, struct pkt *packet);
+
+/* Bottleneck link, one per channel.  spec is "bandwidth,delay,qlimit":
+   bandwidth in bytes per time unit, propagation delay in time units and
+   the FIFO size in packets (including the one being transmitted).  RED
+   spec is "min_th,max_th,max_p[,weight]". */
+extern int link_configure(const char *spec);
+extern int red_configure(const char *spec);
+extern int link_enabled(void);
+
+/* queue a packet sent at now, returns its arrival time at the other side
+   or -1 if the queue dropped it */
+extern double link_send(int channel, double now);
+
+/* fraction of the time up to now the link spent transmitting */
+extern double link_utilization(int channel, double now);
+
+/* least time a packet spends in the medium, link or not */
+extern double channel_lookahead(void);
+
+/* Reordering and duplication.  reorder spec is "prob,maxdelay": a packet
+   is held back with probability prob by an extra uniform [0,maxdelay]
+   time units.  duplicate spec is "prob". */
+extern int reorder_configure(const char *spec);
+extern int duplicate_configure(const char *spec);
+extern double reorder_delay(int channel);   /* extra delay, 0 if not held back */
+extern int duplicate(int channel);          /* whether to deliver a second copy */
+
+/* order in which packets enter the medium, and their arrival in that
+   order (reorder depth statistics) */
+extern long channel_sendseq(int channel);
+extern void channel_count_arrival(int channel, long sendseq);
+
+/* record whether a packet sent on channel was lost (burst statistics) */
+extern void channel_count_loss(int channel, int lost);
+
+/* print the channel model statistics, now is the simulation end time */
+extern void channel_report(double now);
@@ -0,0 +1,390 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "emulator.h"
+#include "checksum.h"
+
+/* ******************************************************************
+   Checksum algorithms shared by the GBN and SR protocols.
+
+   - CHECKSUM_SUM is the original assignment checksum: seqnum + acknum
+   plus the sum of the payload bytes.  Cheap, but it misses reordered
+   bytes and most multi-bit errors.
+   - CHECKSUM_INET is the RFC 1071 ones' complement sum of 16 bit words.
+   - CHECKSUM_CRC32C is the Castagnoli CRC used by iSCSI and SCTP.
+
+   The fastest implementation of each is chosen at run time: the SSE4.2
+   crc32 instruction for CRC32C and SSE2 for the Internet checksum when
+   the CPU has them, portable table/word based code otherwise.
+**********************************************************************/
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <emmintrin.h>
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78U  /* reflected Castagnoli polynomial */
+
+int checksum_type = CHECKSUM_SUM;
+
+static unsigned int crc32c_table[8][256];  /* slicing-by-8 tables */
+static int checksum_ready = 0;
+
+static unsigned int crc32c_sw(unsigned int crc, const unsigned char *p, size_t len);
+static unsigned long inet_sw(unsigned long sum, const unsigned char *p, size_t len);
+
+/* implementations picked by checksum_init() */
+static unsigned int (*crc32c_impl)(unsigned int, const unsigned char *, size_t) = crc32c_sw;
+static unsigned long (*inet_impl)(unsigned long, const unsigned char *, size_t) = inet_sw;
+static const char *crc32c_impl_name = "table";
+static const char *inet_impl_name = "scalar";
+
+
+/********* portable implementations ************/
+
+/* byte sum, the inner loop of the original ComputeChecksum */
+static int sum_bytes(int sum, const unsigned char *p, size_t len)
+{
+  size_t i;
+
+  for (i=0; i<len; i++)
+    sum += (int)((const char *)p)[i];
+  return sum;
+}
+
+static void crc32c_build_tables(void)
+{
+  unsigned int crc;
+  int i, j;
+
+  for (i=0; i<256; i++) {
+    crc = i;
+    for (j=0; j<8; j++)
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    crc32c_table[0][i] = crc;
+  }
+  for (i=0; i<256; i++)
+    for (j=1; j<8; j++)
+      crc32c_table[j][i] = (crc32c_table[j-1][i] >> 8) ^ crc32c_table[0][crc32c_table[j-1][i] & 0xff];
+}
+
+/* slicing-by-8: eight table lookups per 8 input bytes */
+static unsigned int crc32c_sw(unsigned int crc, const unsigned char *p, size_t len)
+{
+  unsigned int lo, hi;
+
+  while (len >= 8) {
+    lo = crc ^ ((unsigned int)p[0] | (unsigned int)p[1] << 8 |
+                (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24);
+    hi = (unsigned int)p[4] | (unsigned int)p[5] << 8 |
+         (unsigned int)p[6] << 16 | (unsigned int)p[7] << 24;
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+          crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+    crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+/* 16 bit words in native byte order, folded often enough that a 32 bit
+   long can never overflow */
+static unsigned long inet_sw(unsigned long sum, const unsigned char *p, size_t len)
+{
+  unsigned short w[4];
+  unsigned char tail[2];
+  size_t n;
+
+  while (len >= 8) {
+    n = len / 8;
+    if (n > 8192)
+      n = 8192;
+    len -= n * 8;
+    while (n--) {
+      memcpy(w, p, 8);
+      sum += (unsigned long)w[0] + w[1] + w[2] + w[3];
+      p += 8;
+    }
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  while (len >= 2) {
+    memcpy(w, p, 2);
+    sum += w[0];
+    p += 2;
+    len -= 2;
+  }
+  if (len) {   /* odd byte is padded with a zero byte (RFC 1071) */
+    tail[0] = *p;
+    tail[1] = 0;
+    memcpy(w, tail, 2);
+    sum += w[0];
+  }
+  return (sum & 0xffff) + (sum >> 16);
+}
+
+
+/********* x86 implementations ************/
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse4.2")))
+static unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len)
+{
+  unsigned int w;
+#ifdef __x86_64__
+  unsigned long d;
+
+  while (len >= 8) {
+    memcpy(&d, p, 8);
+    crc = (unsigned int)_mm_crc32_u64(crc, d);
+    p += 8;
+    len -= 8;
+  }
+#endif
+  while (len >= 4) {
+    memcpy(&w, p, 4);
+    crc = _mm_crc32_u32(crc, w);
+    p += 4;
+    len -= 4;
+  }
+  while (len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+
+/* widen the eight 16 bit words of each 16 byte block into 32 bit lanes */
+__attribute__((target("sse2")))
+static unsigned long inet_sse2(unsigned long sum, const unsigned char *p, size_t len)
+{
+  __m128i acc, v, zero;
+  unsigned int lanes[4];
+  size_t n;
+
+  zero = _mm_setzero_si128();
+  while (len >= 16) {
+    n = len / 16;
+    if (n > 16384)   /* each lane gains at most 2*0xffff per block */
+      n = 16384;
+    len -= n * 16;
+    acc = _mm_setzero_si128();
+    while (n--) {
+      v = _mm_loadu_si128((const __m128i *)p);
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+      p += 16;
+    }
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum += (lanes[0] & 0xffff) + (lanes[0] >> 16) + (lanes[1] & 0xffff) + (lanes[1] >> 16);
+    sum += (lanes[2] & 0xffff) + (lanes[2] >> 16) + (lanes[3] & 0xffff) + (lanes[3] >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return inet_sw(sum, p, len);
+}
+#endif
+
+
+/********* selection and packet checksum ************/
+
+void checksum_init(void)
+{
+  if (checksum_ready)
+    return;
+  crc32c_build_tables();
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    crc32c_impl = crc32c_sse42;
+    crc32c_impl_name = "sse4.2";
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    inet_impl = inet_sse2;
+    inet_impl_name = "sse2";
+  }
+#endif
+  checksum_ready = 1;
+}
+
+int checksum_select(const char *name)
+{
+  if (strcmp(name, "sum") == 0)
+    checksum_type = CHECKSUM_SUM;
+  else if (strcmp(name, "inet") == 0)
+    checksum_type = CHECKSUM_INET;
+  else if (strcmp(name, "crc32c") == 0)
+    checksum_type = CHECKSUM_CRC32C;
+  else
+    return 0;
+  return 1;
+}
+
+const char *checksum_name(void)
+{
+  static char name[32];
+
+  if (checksum_type == CHECKSUM_INET)
+    sprintf(name, "inet (%s)", inet_impl_name);
+  else if (checksum_type == CHECKSUM_CRC32C)
+    sprintf(name, "crc32c (%s)", crc32c_impl_name);
+  else
+    sprintf(name, "sum");
+  return name;
+}
+
+/* chainable like zlib's crc32(): start with 0, pass the previous result */
+unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len)
+{
+  checksum_init();
+  return ~crc32c_impl(~crc, buf, len);
+}
+
+/* returns a partial sum, finish with inet_fold() */
+unsigned long inet_update(unsigned long sum, const void *buf, size_t len)
+{
+  checksum_init();
+  return inet_impl(sum, buf, len);
+}
+
+unsigned int inet_fold(unsigned long sum)
+{
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return (unsigned int)sum;
+}
+
+/* The payload is covered first so that a partial result over a fixed
+   payload can be reused when only the header changes. */
+int pkt_checksum(const struct pkt *packet)
+{
+  unsigned int crc;
+  unsigned long sum;
+
+  switch (checksum_type) {
+  case CHECKSUM_INET:
+    sum = inet_update(0, packet->payload, 20);
+    sum = inet_update(sum, &packet->seqnum, sizeof(packet->seqnum));
+    sum = inet_update(sum, &packet->acknum, sizeof(packet->acknum));
+    return (int)(~inet_fold(sum) & 0xffff);
+  case CHECKSUM_CRC32C:
+    crc = crc32c_update(0, packet->payload, 20);
+    crc = crc32c_update(crc, &packet->seqnum, sizeof(packet->seqnum));
+    crc = crc32c_update(crc, &packet->acknum, sizeof(packet->acknum));
+    return (int)crc;
+  default:
+    return sum_bytes(packet->seqnum + packet->acknum,
+                     (const unsigned char *)packet->payload, 20);
+  }
+}
+
+/* Only the 8 header bytes are touched, so the cost does not depend on
+   the payload size:
+   - sum:    subtract the old header fields and add the new ones.
+   - inet:   HC' = ~(~HC + ~m + m') for every changed 16 bit word (RFC 1624).
+   - crc32c: a CRC is linear over equal length messages, and the header is
+   the last thing covered, so crc(P|H') = crc(P|H) ^ crc0(H ^ H') where
+   crc0 has no initial or final inversion. */
+int pkt_checksum_adjust(const struct pkt *packet, int seqnum, int acknum)
+{
+  int oldhdr[2], newhdr[2];
+  unsigned short oldw[4], neww[4];
+  unsigned long sum;
+  unsigned int crc;
+  int i;
+
+  switch (checksum_type) {
+  case CHECKSUM_INET:
+    oldhdr[0] = packet->seqnum;
+    oldhdr[1] = packet->acknum;
+    newhdr[0] = seqnum;
+    newhdr[1] = acknum;
+    memcpy(oldw, oldhdr, sizeof(oldw));
+    memcpy(neww, newhdr, sizeof(neww));
+    sum = ~(unsigned int)packet->checksum & 0xffff;
+    for (i=0; i<4; i++)
+      sum += (~oldw[i] & 0xffff) + neww[i];
+    return (int)(~inet_fold(sum) & 0xffff);
+  case CHECKSUM_CRC32C:
+    newhdr[0] = packet->seqnum ^ seqnum;
+    newhdr[1] = packet->acknum ^ acknum;
+    crc = ~crc32c_update(0xffffffffU, newhdr, sizeof(newhdr));
+    return (int)((unsigned int)packet->checksum ^ crc);
+  default:
+    return packet->checksum - packet->seqnum - packet->acknum + seqnum + acknum;
+  }
+}
+
+
+/********* benchmark ************/
+
+#define BENCH_BYTES (64L * 1024 * 1024)   /* bytes checksummed per measurement */
+
+static volatile unsigned long bench_sink;
+
+/* MB/s for one algorithm (0 sum, 1 inet scalar, 2 inet simd, 3 crc table, 4 crc simd) */
+static double bench_one(int which, const unsigned char *buf, size_t len)
+{
+  long i, iterations;
+  unsigned long acc = 0;
+  clock_t start;
+  double secs;
+
+  iterations = BENCH_BYTES / (long)len;
+  start = clock();
+  for (i=0; i<iterations; i++) {
+    switch (which) {
+    case 0: acc += (unsigned long)sum_bytes((int)(acc & 0xffff), buf, len); break;
+    case 1: acc += inet_sw(acc & 0xffff, buf, len); break;
+#ifdef HAVE_X86_SIMD
+    case 2: acc += inet_sse2(acc & 0xffff, buf, len); break;
+    case 4: acc += crc32c_sse42((unsigned int)acc, buf, len); break;
+#endif
+    case 3: acc += crc32c_sw((unsigned int)acc, buf, len); break;
+    }
+  }
+  secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+  bench_sink += acc;
+  if (secs <= 0.0)
+    return 0.0;
+  return (double)iterations * len / secs / 1e6;
+}
+
+void checksum_benchmark(void)
+{
+  static const size_t sizes[] = { 20, 64, 256, 1500, 9000, 65536 };
+  unsigned char *buf;
+  size_t i;
+  int simd = 0;
+
+  checksum_init();
+#ifdef HAVE_X86_SIMD
+  simd = (crc32c_impl != crc32c_sw);
+#endif
+  buf = malloc(65536);
+  if (buf == 0) {
+    printf("memory allocation for benchmark failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (i=0; i<65536; i++)
+    buf[i] = (unsigned char)rand();
+
+  printf("checksum throughput in MB/s\n");
+  printf("%8s %10s %12s %12s %12s %12s\n", "bytes", "sum", "inet-scalar", "inet-simd",
+         "crc32c-table", "crc32c-hw");
+  for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+    printf("%8lu %10.1f %12.1f", (unsigned long)sizes[i], bench_one(0, buf, sizes[i]),
+           bench_one(1, buf, sizes[i]));
+    if (inet_impl != inet_sw)
+      printf(" %12.1f", bench_one(2, buf, sizes[i]));
+    else
+      printf(" %12s", "-");
+    printf(" %12.1f", bench_one(3, buf, sizes[i]));
+    if (simd)
+      printf(" %12.1f\n", bench_one(4, buf, sizes[i]));
+    else
+      printf(" %12s\n", "-");
+  }
+  free(buf);
+}
@@ -0,0 +1,32 @@
+#include <stddef.h>
+
+/* checksum algorithms that can be selected for a run */
+#define CHECKSUM_SUM     0   /* plain byte sum (original assignment checksum) */
+#define CHECKSUM_INET    1   /* RFC 1071 ones' complement Internet checksum */
+#define CHECKSUM_CRC32C  2   /* CRC32C (Castagnoli) */
+
+extern int checksum_type;
+
+/* select algorithm by name ("sum", "inet", "crc32c"), returns 0 if unknown */
+extern int checksum_select(const char *name);
+
+/* name of the selected algorithm and the implementation chosen for this CPU */
+extern const char *checksum_name(void);
+
+/* detect CPU features and pick the fastest implementations */
+extern void checksum_init(void);
+
+/* checksum of a packet's seqnum, acknum and payload with the selected algorithm */
+extern int pkt_checksum(const struct pkt *packet);
+
+/* checksum of packet with its header replaced by seqnum/acknum, derived
+   from packet->checksum in constant time (RFC 1624 style) */
+extern int pkt_checksum_adjust(const struct pkt *packet, int seqnum, int acknum);
+
+/* raw building blocks, usable on buffers of any length */
+extern unsigned int crc32c_update(unsigned int crc, const void *buf, size_t len);
+extern unsigned long inet_update(unsigned long sum, const void *buf, size_t len);
+extern unsigned int inet_fold(unsigned long sum);
+
+/* time every algorithm against the byte sum at 20 byte to 64 KB buffers */
+extern void checksum_benchmark(void);
@@ -36,24 +36,244 @@
    ********************************************************************* */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
 #include "emulator.h"
 #include "gbn.h"
+#ifdef MULTIPROTOCOL
+#include "sr.h"
+#endif
+#include "checksum.h"
+#include "channel.h"
+#include "parallel.h"
+#include "traffic.h"
+#include "pcap.h"
 
+/* Events are built and run by value; the event list keeps their time
+   in the heap key, the rest in a small record and the packet of a
+   FROM_LAYER3 in a pool of its own, all addressed by 32 bit index. */
 struct event {
-  float evtime;           /* event time */
+  simtime evtime;         /* event time */
+  long sendseq;           /* order the packet entered the medium, -1 for copies */
   int evtype;             /* event type code */
   int eventity;           /* entity where event occurs */
-  struct pkt *pktptr;     /* ptr to packet (if any) assoc w/ this event */
-  struct event *prev;
-  struct event *next;
+  int flow;               /* flow the entity belongs to */
+  int nmsgs;              /* messages a FROM_LAYER5 hands out */
+  int msgnum;             /* number of the first of them (partitioned engine) */
+  int corrupt;            /* the channel corrupted the packet */
+  int fecblock;           /* FEC block of one of A's packets, */
+  int fecindex;           /* its place in it (fec for the parity), -1 none */
+  struct pkt pkt;         /* the packet of a FROM_LAYER3 */
 };
 
-struct event *evlist = NULL;   /* the event list */
+/* what the pool keeps of an event, 12 bytes */
+struct evrec {
+  signed char evtype;
+  unsigned char eventity;
+  unsigned char letter;   /* msgnum modulo 26, all a FROM_LAYER5 uses of it */
+  int flow;
+  unsigned int data;      /* nmsgs of a FROM_LAYER5, packet of a FROM_LAYER3 */
+};
+
+/* the packet of a FROM_LAYER3 and what the channel said about it */
+struct evpacket {
+  struct pkt pkt;
+  long sendseq;
+  int fecblock;
+  signed char fecindex;
+  char corrupt;
+};
+
+/* what the heap orders by: time, then the latest inserted first, with
+   the index of the record so that sifting never touches the records */
+struct evkey {
+  simtime time;           /* the time of the event, kept nowhere else */
+  unsigned int seq;       /* insertion order, modulo 2^32 */
+  unsigned int ev;        /* record in the pool */
+};
+
+#define NOEVENT 0xffffffffU
+
+/* a random number stream of its own (xorshift128), so that what one
+   partition draws does not depend on how the others interleave with it */
+struct rng {
+  unsigned long s[4];
+};
+
+/* A partition is one path and the flows on it, with its own event list
+   and clock.  The sequential engine runs everything in partition 0; the
+   partitioned engine (-threads) gives every path a partition.  The event
+   list is a binary heap of keys over a pool of event records, so that
+   inserting and removing cost O(log n) with many flows in flight and the
+   comparisons stay within the key array.  A cancelled timer is only
+   marked in its record and its key dropped when it reaches the top. */
+struct partition {
+  struct evkey *evheap;
+  int nevents;            /* keys in the heap, cancelled ones included */
+  int nlive;              /* events still to run */
+  int evheapsize;
+  unsigned int nscheduled;
+  struct evrec *pool;     /* event records */
+  unsigned int *freeev;   /* stack of the free ones */
+  unsigned int poolsize, nfree;
+  struct evpacket *packets;       /* packets of the FROM_LAYER3 records */
+  unsigned int *freepkt;          /* stack of the free ones */
+  unsigned int pktpoolsize, nfreepkt;
+  simtime time;           /* time of its latest event */
+  struct rng rng;         /* channel draws on its path */
+};
+
+static struct partition *parts;
+static int nparts = 1;
+static int partitioned = 0;       /* run the partitioned engine */
+static int saturated = 0;         /* backlogged sources instead of layer 5 arrivals */
+static double timeout = 0.0;      /* replaces the protocol's timer increment when set */
+static int fec = 0;               /* a parity packet after every fec packets of A, 0 none */
+static int consumer = 0;          /* processing time model of B's application, CONSUMER_* */
+static double consumertime;       /* its (mean) time per message */
+static int nthreads = 1;          /* threads running the partitions */
+static int nvariants = 0;         /* what-if copies forked at the warm-up time */
+static double warmup = -1.0;      /* time to fork the variants at */
+static int variant = 0;           /* which copy this process is, 0 the original */
+static unsigned long seed = 9999; /* of srand() and the partitioned engine's streams */
+static int replication = -1;      /* replication this process runs, -1 none */
+static THREADLOCAL struct rng *rngstream = NULL;  /* NULL: the system rand() */
+
+/* protocol entry points; a -DMULTIPROTOCOL build links GBN and SR
+   together and each flow picks one of them */
+struct protocol {
+  const char *name;
+  void (*A_init)(void);
+  void (*B_init)(void);
+  void (*A_input)(struct pkt);
+  void (*B_input)(struct pkt);
+  void (*A_output)(struct msg);
+  int (*A_ready)(void);
+  int (*A_inflight)(void);
+  int (*A_window)(void);
+  void (*A_timerinterrupt)(void);
+  void (*B_output)(struct msg);
+  void (*B_timerinterrupt)(void);
+  void (*B_appready)(void);
+};
+
+#ifdef MULTIPROTOCOL
+static struct protocol protocols[] = {
+  { "gbn", gbn_A_init, gbn_B_init, gbn_A_input, gbn_B_input, gbn_A_output,
+    gbn_A_ready, gbn_A_inflight, gbn_A_window, gbn_A_timerinterrupt, gbn_B_output, gbn_B_timerinterrupt,
+    gbn_B_appready },
+  { "sr", sr_A_init, sr_B_init, sr_A_input, sr_B_input, sr_A_output,
+    sr_A_ready, sr_A_inflight, sr_A_window, sr_A_timerinterrupt, sr_B_output, sr_B_timerinterrupt,
+    sr_B_appready }
+};
+#else
+static struct protocol protocols[] = {
+  { "default", A_init, B_init, A_input, B_input, A_output,
+    A_ready, A_inflight, A_window, A_timerinterrupt, B_output, B_timerinterrupt, B_appready }
+};
+#endif
+#define NPROTOCOLS ((int)(sizeof(protocols) / sizeof(protocols[0])))
+
+/* one sender (A) / receiver (B) pair */
+struct flow {
+  int protocol;           /* index in protocols[] */
+  int path;               /* the shared path its packets cross */
+  int generated;          /* messages handed to A */
+  int packets;            /* packets A sent into layer 3 */
+  int delivered;          /* messages delivered to B's application */
+  simtime lastdelivery;   /* time of the latest one */
+  int quota;              /* messages of a saturated source */
+  int waiting;            /* messages of the arrival being handed to A after this one */
+  int window_full;        /* protocol statistics attributed to this flow */
+  int packets_resent;
+  int new_ACKs;
+  int packets_received;
+  unsigned int timer[2];   /* running timer of A and B, or NOEVENT */
+  simtime lastarrival[2];  /* latest in-order arrival scheduled at A and B */
+  struct rng arrivals;     /* partitioned engine: message arrival stream, */
+  simtime nextarrival;     /* the next arrival time, */
+  int nextmsgs;            /* its messages */
+  int nextentity;          /* and the entity they go to */
+  simtime *taken;          /* ring of the times A took the messages not yet */
+  int ntaken, firsttaken, takensize;  /* delivered, in order */
+  double latency;          /* summed latency of the delivered messages */
+  int deliveries;          /* calls delivering them to the application */
+  int largestbatch;        /* most messages one of them delivered */
+  int corruptarrivals;     /* corrupted packets that reached A or B */
+  int undetected;          /* of them with a checksum that still matched */
+  struct fecstate *fec;    /* -fec: encoder at A, decoder at B */
+  int appbusy;             /* -consumer: B's application is processing a message */
+  double appbusytime;      /* summed time it spent processing */
+  int overruns;            /* messages handed to it while it was busy, lost */
+};
+
+/* Forward error correction (-fec k) between A's protocol and the
+   channel: every k packets A sends are followed by a parity packet, the
+   XOR of their headers and payloads, and B rebuilds a single packet
+   missing from a block from the others and the parity.  The FEC layer
+   tags the packets with their block and place in an event field of its
+   own, and is taken to check them with a CRC of its own, so corrupted
+   packets count as missing.  B's layer passes the packets on as they
+   come and after a rebuild hands B the rebuilt packet alone, never one
+   it has already been given.  Only the newest block to reach B is
+   decoded, so a rebuilt packet is never older than data B has taken
+   from a later block; and it is withheld if it copies one of the last
+   FECSEEN packets B was given, as a late copy of a packet B has since
+   moved past could be taken for a new one.  Rebuilt packets are remembered for
+   FECHORIZON blocks to time the resends that followed anyway. */
+#define FECREBUILT 16
+#define FECHORIZON 4
+#define FECSEEN 64
+
+struct fecstate {
+  int block;               /* block being filled at A */
+  int n;                   /* packets in it */
+  struct pkt parity;       /* their XOR */
+  int decblock;            /* block being decoded at B */
+  unsigned long have;      /* places received in it, the parity's included */
+  int nhave;
+  struct pkt sum;          /* XOR of the packets received */
+  struct pkt held[32];     /* packets received, by place */
+  int parities;            /* parity packets sent */
+  int recovered;           /* packets rebuilt */
+  int failed;              /* blocks that lost more than one packet */
+  int unsafe;              /* rebuilt packets withheld as copies B may have had */
+  struct {                 /* the last packets passed to B */
+    int seqnum, checksum;
+  } seen[FECSEEN];
+  int nseen, lastseen;
+  struct {                 /* recently rebuilt packets, to time their resends */
+    int seqnum, checksum, block;
+    simtime time;
+  } rebuilt[FECREBUILT];
+  int nrebuilt;
+  double saved;            /* summed time the rebuilt packets beat their resends by */
+  int nsaved;
+};
+
+/* A slow application at B (-consumer).  It takes one message at a
+   time and processes it for a fixed time or an exponential time of the
+   given mean; tolayer5_room() tells B's protocol whether it would take a
+   message now and an APP_READY event calls B_appready() when it is done.
+   A message handed to it while it is busy is lost. */
+#define CONSUMER_NONE  0
+#define CONSUMER_FIXED 1
+#define CONSUMER_EXP   2
+
+static struct flow *flows;
+int nflows = 1;                   /* number of sender/receiver pairs */
+THREADLOCAL int current_flow = 0; /* flow whose entity is running */
+static int npaths = 1;            /* shared paths the flows are spread over */
+static int flowprotocol[16];      /* protocols assigned round robin to flows */
+static int nflowprotocols = 0;
 
 /* possible events: */
 #define  TIMER_INTERRUPT 0  
 #define  FROM_LAYER5     1
 #define  FROM_LAYER3     2
+#define  APP_READY       3      /* B's application finished a message */
+#define  CANCELLED       (-1)   /* a stopped timer still in the heap */
 
 #define  OFF             0
 #define  ON              1
@@ -61,29 +281,60 @@ struct event *evlist = NULL;   /* the event list */
 int TRACE = 3;
 
 /* statistics updated by GBN */
-int window_full;   /* count of the number of messages dropped due to full window */
-int total_ACKs_received;
-int packets_resent;       /* count of the number of packets resent  */
-int new_ACKs;           /* count of the number of acks correctly received */
-int packets_received;  /* count of the packets received by receiver */
+THREADLOCAL int window_full;   /* count of the number of messages dropped due to full window */
+THREADLOCAL int total_ACKs_received;
+THREADLOCAL int packets_resent;       /* count of the number of packets resent  */
+THREADLOCAL int new_ACKs;           /* count of the number of acks correctly received */
+THREADLOCAL int packets_received;  /* count of the packets received by receiver */
 
 /* statistics updated by emulator */
 static int packets_lost;  
 static int packets_corrupt;
 static int packets_sent;
 static int packets_timeout;
-static int messages_delivered;
+static THREADLOCAL int messages_delivered;
 
 static int nsim = 0;              /* number of messages from 5 to 4 so far */ 
 static int nsimmax = 0;           /* number of msgs to generate, then stop */
-static float time = 0.000;
+static THREADLOCAL simtime time = 0.000;
 static float lossprob;            /* probability that a packet is dropped  */
 static float corruptprob;   /* probability that one bit is packet is flipped */
 static int corruptdirection; /* A->B A<-B or bidirectional corruption/loss */
 static float lambda;        /* arrival rate of messages from layer 5 */   
-static int   ntolayer3;           /* number sent into layer 3 */
-static int   nlost;               /* number lost in media */
-static int ncorrupt;              /* number corrupted by media*/
+static THREADLOCAL int   ntolayer3;           /* number sent into layer 3 */
+static THREADLOCAL int   nlost;               /* number lost in media */
+static THREADLOCAL int ncorrupt;              /* number corrupted by media*/
+
+/* the next number of stream r, uniform in [0,1] */
+double rng_next(struct rng *r)
+{
+  unsigned long t = (r->s[0] ^ (r->s[0] << 11)) & 0xffffffffUL;
+
+  r->s[0] = r->s[1];
+  r->s[1] = r->s[2];
+  r->s[2] = r->s[3];
+  r->s[3] = r->s[3] ^ (r->s[3] >> 19) ^ t ^ (t >> 8);
+  return r->s[3] / 4294967295.0;
+}
+
+/* stream number id, derived from the same seed as srand() */
+void rng_seed(struct rng *r, unsigned long id)
+{
+  unsigned long x;
+  int i;
+
+  for (i=0; i<4; i++) {
+    x = (seed + id * 4 + i) & 0xffffffffUL;     /* lowbias32 hash */
+    x ^= x >> 16;
+    x = (x * 0x7feb352dUL) & 0xffffffffUL;
+    x ^= x >> 15;
+    x = (x * 0x846ca68bUL) & 0xffffffffUL;
+    x ^= x >> 16;
+    r->s[i] = x;
+  }
+  if ((r->s[0] | r->s[1] | r->s[2] | r->s[3]) == 0)
+    r->s[0] = 1;
+}
 
 /****************************************************************************/
 /* jimsrand(): return a double in range [0,1].  The routine below is used to */
@@ -94,7 +345,10 @@ double jimsrand(void)
 {
   double mmm = RAND_MAX;     /* largest int  - MACHINE DEPENDENT!!!!!!!!   */
   double x;                   
-  x = rand()/mmm;            /* x should be uniform in [0,1] */
+  if (rngstream != NULL)
+    x = rng_next(rngstream);
+  else
+    x = rand()/mmm;            /* x should be uniform in [0,1] */
   if (TRACE > 3)
     printf("RANDOM NUMBER GENERAION CALLED: %f\n", x);
   return(x);
@@ -104,79 +358,417 @@ double jimsrand(void)
 /*  The next set of routines handle the event list   */
 /*****************************************************/
 
-void insertevent(struct event *p)
+/* p fires before q; among equal times the most recently inserted event
+   goes first, the order the original sorted list insertion gave */
+int evbefore(const struct evkey *p, const struct evkey *q)
+{
+  if (p->time != q->time)
+    return p->time < q->time;
+  return p->seq != q->seq && p->seq - q->seq < 0x80000000U;
+}
+
+void evsiftup(struct partition *q, int pos)
+{
+  struct evkey k = q->evheap[pos];
+
+  while (pos > 0 && evbefore(&k, &q->evheap[(pos-1)/2])) {
+    q->evheap[pos] = q->evheap[(pos-1)/2];
+    pos = (pos-1)/2;
+  }
+  q->evheap[pos] = k;
+}
+
+void evsiftdown(struct partition *q, int pos)
+{
+  struct evkey k = q->evheap[pos];
+  int child;
+
+  while ((child = 2*pos + 1) < q->nevents) {
+    if (child+1 < q->nevents && evbefore(&q->evheap[child+1], &q->evheap[child]))
+      child++;
+    if (!evbefore(&q->evheap[child], &k))
+      break;
+    q->evheap[pos] = q->evheap[child];
+    pos = child;
+  }
+  q->evheap[pos] = k;
+}
+
+/* the partition whose event list holds the events of flow */
+struct partition *partitionof(int flow)
+{
+  return partitioned ? &parts[flows[flow].path] : &parts[0];
+}
+
+/* take the top key off the heap and free its record and packet */
+void dropkey(struct partition *q)
+{
+  struct evrec *r = &q->pool[q->evheap[0].ev];
+
+  if (r->evtype == FROM_LAYER3)
+    q->freepkt[q->nfreepkt++] = r->data;
+  q->freeev[q->nfree++] = q->evheap[0].ev;
+  if (--q->nevents > 0) {
+    q->evheap[0] = q->evheap[q->nevents];
+    evsiftdown(q, 0);
+  }
+}
+
+/* schedule a copy of e, returns the index of its record */
+unsigned int insertevent(const struct event *e)
 {
-  struct event *q,*qold;
+  struct partition *q = partitionof(e->flow);
+  struct evrec *r;
+  struct evpacket *p;
+  unsigned int ev, i;
 
   if (TRACE>2) {
     printf("            INSERTEVENT: time is %f\n",time);
-    printf("            INSERTEVENT: future time will be %f\n",p->evtime); 
+    printf("            INSERTEVENT: future time will be %f\n",e->evtime); 
   }
-  q = evlist;     /* q points to front of list in which p struct inserted */
-  if (q==NULL) {   /* list is empty */
-    evlist=p;
-    p->next=NULL;
-    p->prev=NULL;
-  }
-  else {
-    for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next)
-      qold=q; 
-    if (q==NULL) {   /* end of list */
-      qold->next = p;
-      p->prev = qold;
-      p->next = NULL;
+  if (q->nfree == 0) {
+    i = q->poolsize;
+    q->poolsize = q->poolsize ? 2*q->poolsize : 64;
+    q->pool = realloc(q->pool, q->poolsize * sizeof(struct evrec));
+    q->freeev = realloc(q->freeev, q->poolsize * sizeof(unsigned int));
+    if (q->pool == 0 || q->freeev == 0 || q->poolsize > NOEVENT / 2) {
+      printf("memory allocation for event list failed.");
+      exit(EXIT_FAILURE);
     }
-    else if (q==evlist) { /* front of list */
-      p->next=evlist;
-      p->prev=NULL;
-      p->next->prev=p;
-      evlist = p;
+    for (ev = q->poolsize; ev > i; ev--)
+      q->freeev[q->nfree++] = ev - 1;
+  }
+  if (q->nevents == q->evheapsize) {
+    q->evheapsize = q->evheapsize ? 2*q->evheapsize : 64;
+    q->evheap = realloc(q->evheap, q->evheapsize * sizeof(struct evkey));
+    if (q->evheap == 0) {
+      printf("memory allocation for event list failed.");
+      exit(EXIT_FAILURE);
     }
-    else {     /* middle of list */
-      p->next=q;
-      p->prev=q->prev;
-      q->prev->next=p;
-      q->prev=p;
+  }
+  if (e->evtype == FROM_LAYER3 && q->nfreepkt == 0) {
+    i = q->pktpoolsize;
+    q->pktpoolsize = q->pktpoolsize ? 2*q->pktpoolsize : 64;
+    q->packets = realloc(q->packets, q->pktpoolsize * sizeof(struct evpacket));
+    q->freepkt = realloc(q->freepkt, q->pktpoolsize * sizeof(unsigned int));
+    if (q->packets == 0 || q->freepkt == 0) {
+      printf("memory allocation for event list failed.");
+      exit(EXIT_FAILURE);
     }
+    for (ev = q->pktpoolsize; ev > i; ev--)
+      q->freepkt[q->nfreepkt++] = ev - 1;
+  }
+  ev = q->freeev[--q->nfree];
+  r = &q->pool[ev];
+  r->evtype = e->evtype;
+  r->eventity = e->eventity;
+  r->letter = e->evtype == FROM_LAYER5 ? e->msgnum % 26 : 0;
+  r->flow = e->flow;
+  r->data = e->evtype == FROM_LAYER5 ? e->nmsgs : 0;
+  if (e->evtype == FROM_LAYER3) {
+    r->data = q->freepkt[--q->nfreepkt];
+    p = &q->packets[r->data];
+    p->pkt = e->pkt;
+    p->sendseq = e->sendseq;
+    p->fecblock = e->fecblock;
+    p->fecindex = e->fecindex;
+    p->corrupt = e->corrupt;
   }
+  q->evheap[q->nevents].time = e->evtime;
+  q->evheap[q->nevents].seq = q->nscheduled++;
+  q->evheap[q->nevents].ev = ev;
+  evsiftup(q, q->nevents++);
+  q->nlive++;
+  return ev;
 }
 
-void generate_next_arrival(void)
+/* take event ev of flow off the event list */
+void cancelevent(int flow, unsigned int ev)
 {
-  double x;
-  struct event *evptr;
+  struct partition *q = partitionof(flow);
+
+  q->pool[ev].evtype = CANCELLED;
+  q->nlive--;
+  while (q->nevents > 0 && q->pool[q->evheap[0].ev].evtype == CANCELLED)
+    dropkey(q);
+}
+
+/* remove the next event of partition q into e, 0 when its list is empty */
+int popevent(struct partition *q, struct event *e)
+{
+  struct evrec *r;
+  struct evpacket *p;
+
+  if (q->nevents == 0)
+    return 0;
+  r = &q->pool[q->evheap[0].ev];
+  e->evtime = q->evheap[0].time;
+  e->evtype = r->evtype;
+  e->eventity = r->eventity;
+  e->flow = r->flow;
+  e->nmsgs = e->evtype == FROM_LAYER5 ? (int)r->data : 0;
+  e->msgnum = r->letter;
+  if (e->evtype == FROM_LAYER3) {
+    p = &q->packets[r->data];
+    e->pkt = p->pkt;
+    e->sendseq = p->sendseq;
+    e->fecblock = p->fecblock;
+    e->fecindex = p->fecindex;
+    e->corrupt = p->corrupt;
+  }
+  dropkey(q);
+  q->nlive--;
+  while (q->nevents > 0 && q->pool[q->evheap[0].ev].evtype == CANCELLED)
+    dropkey(q);
+  return 1;
+}
+
+/* the messages a layer 5 arrival of that many bytes is split into */
+int msgcount(int bytes)
+{
+  return bytes > 20 ? (bytes + 19) / 20 : 1;
+}
+
+void generate_next_arrival(int flow)
+{
+  double when;
+  int bytes;
+  struct event ev;
 
   if (TRACE>2)
     printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
  
-  x = lambda*jimsrand()*2;  /* x is uniform on [0,2*lambda] */
-  /* having mean of lambda        */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  evptr->evtime =  time + x;
-  evptr->evtype =  FROM_LAYER5;
+  if (!traffic_next(&flow, time, &when, &bytes))
+    return;                   /* the traffic trace has ended */
+  ev.evtime =  when;
+  ev.evtype =  FROM_LAYER5;
+  ev.flow = flow;
+  ev.nmsgs = msgcount(bytes);
   if (BIDIRECTIONAL && (jimsrand()>0.5) )
-    evptr->eventity = B;
+    ev.eventity = B;
   else
-    evptr->eventity = A;
-  insertevent(evptr);
+    ev.eventity = A;
+  insertevent(&ev);
 } 
 
-void printevlist(void)
+/* The partitioned engine draws the message arrivals of every flow from
+   a stream of its own, one ahead, and keeps the flows in a heap by their
+   next arrival, so that messages are numbered in time order over all
+   flows as in the sequential engine.  The heap keeps a copy of the time
+   so that sifting does not touch the flows. */
+struct arrival {
+  simtime time;
+  int flow;
+};
+static struct arrival *arrivalheap;
+
+int arrivalbefore(struct arrival *p, struct arrival *q)
+{
+  if (p->time != q->time)
+    return p->time < q->time;
+  return p->flow < q->flow;
+}
+
+void arrivalsiftdown(int pos)
 {
-  struct event *q;
-  printf("--------------\nEvent List Follows:\n");
-  for(q = evlist; q!=NULL; q=q->next) {
-    printf("Event time: %f, type: %d entity: %d\n",q->evtime,q->evtype,q->eventity);
+  struct arrival a = arrivalheap[pos];
+  int child;
+
+  while ((child = 2*pos + 1) < nflows) {
+    if (child+1 < nflows && arrivalbefore(&arrivalheap[child+1], &arrivalheap[child]))
+      child++;
+    if (!arrivalbefore(&arrivalheap[child], &a))
+      break;
+    arrivalheap[pos] = arrivalheap[child];
+    pos = child;
   }
+  arrivalheap[pos] = a;
+}
+
+/* draw the arrival after flow's current next one */
+void draw_next_arrival(int flow)
+{
+  struct flow *fl = &flows[flow];
+  double when;
+  int bytes;
+
+  rngstream = &fl->arrivals;
+  traffic_next(&flow, fl->nextarrival, &when, &bytes);
+  fl->nextarrival = when;
+  fl->nextmsgs = msgcount(bytes);
+  if (BIDIRECTIONAL && (jimsrand()>0.5) )
+    fl->nextentity = B;
+  else
+    fl->nextentity = A;
+  rngstream = NULL;
+}
+
+/* hand the partitions the messages that arrive before end */
+void injectarrivals(double end)
+{
+  struct event ev;
+  int f;
+
+  while (!saturated && nsim < nsimmax && arrivalheap[0].time < end) {
+    f = arrivalheap[0].flow;
+    ev.evtime = flows[f].nextarrival;
+    ev.evtype = FROM_LAYER5;
+    ev.eventity = flows[f].nextentity;
+    ev.flow = f;
+    ev.nmsgs = flows[f].nextmsgs;
+    if (ev.nmsgs > nsimmax - nsim)
+      ev.nmsgs = nsimmax - nsim;
+    ev.msgnum = nsim;
+    nsim += ev.nmsgs;
+    insertevent(&ev);
+    draw_next_arrival(f);
+    arrivalheap[0].time = flows[f].nextarrival;
+    arrivalsiftdown(0);
+  }
+}
+
+void printevlist(void)
+{
+  struct evrec *q;
+  int i, p;
+  printf("--------------\nEvent List Follows (heap order):\n");
+  for (p = 0; p < nparts; p++)
+    for(i = 0; i < parts[p].nevents; i++) {
+      q = &parts[p].pool[parts[p].evheap[i].ev];
+      if (q->evtype != CANCELLED)
+        printf("Event time: %f, type: %d entity: %d flow: %d\n",(double)parts[p].evheap[i].time,q->evtype,q->eventity,q->flow);
+    }
   printf("--------------\n");
 }
 
+/* Independent replications (-replicate): the run is repeated with seeds
+   9999, 10000, ... until the 95% confidence interval of every metric is
+   within the requested fraction of its mean.  The replications are forked
+   copies, -jobs of them at a time, but the stopping rule only looks at
+   the first ones in seed order that have all finished, so the outcome is
+   the same for any number of jobs. */
+#define NMETRICS 3
+static const char *metricname[NMETRICS] = { "goodput", "latency", "packets_resent" };
+static double repwidth = 0.0;     /* relative half-width to reach, 0 a single run */
+static int repmin = 3;            /* replications before the rule applies */
+static int repmax = 100;          /* and the most to run */
+static int jobs = 0;              /* replications at once, 0 one per processor */
+static double stallgap;           /* a run delivering nothing this long has stalled */
+static double stallcheck = 0.0;   /* when to look for a stall next */
+static int repstalled = 0;        /* the run ended because it stalled */
+
+/* Student t quantile of a two sided 95% interval */
+double tquantile(int df)
+{
+  static const double t[30] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+  double z = 1.959964;
+
+  if (df <= 30)
+    return t[df - 1];
+  return z + (z*z*z + z) / (4.0 * df) + (5*z*z*z*z*z + 16*z*z*z + 3*z) / (96.0 * df * df);
+}
+
+/* mean and interval half-width of metric m over the first n replications */
+void repinterval(const double *results, int n, int m, double *mean, double *half)
+{
+  double sum = 0.0, var = 0.0;
+  int r;
+
+  for (r=0; r<n; r++)
+    sum += results[r*NMETRICS + m];
+  *mean = sum / n;
+  for (r=0; r<n; r++)
+    var += (results[r*NMETRICS + m] - *mean) * (results[r*NMETRICS + m] - *mean);
+  *half = n > 1 ? tquantile(n - 1) * sqrt(var / (n - 1) / n) : 0.0;
+}
+
+int repconverged(const double *results, int n)
+{
+  double mean, half;
+  int m;
+
+  for (m=0; m<NMETRICS; m++) {
+    repinterval(results, n, m, &mean, &half);
+    if (half > repwidth * fabs(mean))
+      return 0;
+  }
+  return 1;
+}
+
+/* run the replications; returns only in one of them, with its seed set.
+   A replication whose protocol stops delivering is reported as stalled
+   and left out of the intervals. */
+void replicate(void)
+{
+  double *raw, *results, v[NMETRICS + 1], mean, half;
+  char *done;
+  int next = 0, running = 0, have = 0, nresults = 0, stop = 0, n, id, m;
+
+  raw = malloc(repmax * (NMETRICS + 1) * sizeof(double));
+  results = malloc(repmax * NMETRICS * sizeof(double));
+  done = calloc(repmax, 1);
+  if (raw == 0 || results == 0 || done == 0) {
+    printf("memory allocation for replications failed.");
+    exit(EXIT_FAILURE);
+  }
+  n = jobs > 0 ? jobs : parallel_cpus();
+  printf("\nreplications until every 95%% confidence interval is within %.1f%% of its mean, %d at a time:\n",
+         100.0 * repwidth, n);
+  printf("  %11s %10s %10s %14s\n", "replication", metricname[0], metricname[1], metricname[2]);
+  while (!stop && have < repmax) {
+    for (; running < n && next < repmax; next++, running++)
+      if (parallel_spawn(next)) {
+        replication = next;
+        seed = 9999 + next;
+        free(raw);
+        free(results);
+        free(done);
+        return;
+      }
+    id = parallel_reap(v, NMETRICS + 1);
+    running--;
+    for (m=0; m<=NMETRICS; m++)
+      raw[id*(NMETRICS + 1) + m] = v[m];
+    done[id] = 1;
+    /* take them in seed order */
+    while (!stop && have < next && done[have]) {
+      v[0] = raw[have*(NMETRICS + 1)];
+      v[1] = raw[have*(NMETRICS + 1) + 1];
+      v[2] = raw[have*(NMETRICS + 1) + 2];
+      if (raw[have*(NMETRICS + 1) + NMETRICS] != 0.0)
+        printf("  %11d stalled: the protocol stopped delivering\n", have);
+      else {
+        printf("  %11d %10.5f %10.3f %14.0f\n", have, v[0], v[1], v[2]);
+        for (m=0; m<NMETRICS; m++)
+          results[nresults*NMETRICS + m] = v[m];
+        nresults++;
+      }
+      have++;
+      stop = nresults >= repmin && repconverged(results, nresults);
+    }
+  }
+  parallel_cancel();
+  if (stop)
+    printf("converged after %d replications", have);
+  else
+    printf("stopped at the limit of %d replications without converging", have);
+  if (have > nresults)
+    printf(", %d of them stalled and left out", have - nresults);
+  printf(":\n");
+  for (m=0; m<NMETRICS && nresults > 0; m++) {
+    repinterval(results, nresults, m, &mean, &half);
+    printf("  %-14s %12.5f +- %-10.5f (%.2f%% of the mean)\n", metricname[m], mean, half,
+           mean != 0.0 ? 100.0 * half / fabs(mean) : 0.0);
+  }
+  exit(EXIT_SUCCESS);
+}
+
 void init(void)                         /* initialize the simulator */
 {
+  struct event ev;
   float sum, avg;
   int i;
 
@@ -197,7 +789,9 @@ void init(void)                         /* initialize the simulator */
   scanf("%d",&TRACE);
 
 
-  srand(9999);              /* init random number generator */
+  if (repwidth > 0.0)
+    replicate();            /* returns in a replication only */
+  srand(seed);              /* init random number generator */
   sum = 0.0;                /* test random number generator for students */
   for (i=0; i<1000; i++)
     sum+=jimsrand();    /* jimsrand() should be uniform in [0,1] */
@@ -225,8 +819,389 @@ void init(void)                         /* initialize the simulator */
   nlost = 0;
   ncorrupt = 0;
 
+  checksum_init();
+  channel_init(npaths);
+  traffic_init(lambda);
+  stallgap = 1000.0 * (channel_lookahead() + lambda);
+  stallcheck = stallgap;
+  if (partitioned && nvariants > 0) {
+    printf("forking variants needs the sequential engine.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (partitioned && traffic_trace()) {
+    printf("a traffic trace needs the sequential engine.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  nparts = partitioned ? npaths : 1;
+  if (nthreads > nparts)
+    nthreads = nparts;
+  parts = calloc(nparts, sizeof(struct partition));
+  if (parts == 0) {
+    printf("memory allocation for partitions failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (i=0; i<nparts; i++)
+    rng_seed(&parts[i].rng, 2*i + 1);
+
+  flows = calloc(nflows, sizeof(struct flow));
+  if (flows == 0) {
+    printf("memory allocation for flows failed.");
+    exit(EXIT_FAILURE);
+  }
+  for (i=0; i<nflows; i++) {
+    flows[i].path = i % npaths;
+    flows[i].timer[A] = flows[i].timer[B] = NOEVENT;
+    if (fec > 0) {
+      flows[i].fec = calloc(1, sizeof(struct fecstate));
+      if (flows[i].fec == 0) {
+        printf("memory allocation for FEC failed.");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (nflowprotocols > 0)
+      flows[i].protocol = flowprotocol[i % nflowprotocols];
+  }
+
   time=0.0;                    /* initialize time to 0.0 */
-  generate_next_arrival();     /* initialize event list */
+  if (saturated) {
+    /* each source gets its share of the messages and starts at once */
+    for (i=0; i<nflows; i++) {
+      flows[i].quota = nsimmax / nflows + (i < nsimmax % nflows);
+      ev.evtime = 0.0;
+      ev.evtype = FROM_LAYER5;
+      ev.eventity = A;
+      ev.flow = i;
+      ev.nmsgs = 0;
+      insertevent(&ev);
+    }
+  }
+  else if (partitioned) {
+    arrivalheap = malloc(nflows * sizeof(struct arrival));
+    if (arrivalheap == 0) {
+      printf("memory allocation for arrivals failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i=0; i<nflows; i++) {
+      rng_seed(&flows[i].arrivals, 2*i);
+      draw_next_arrival(i);
+      arrivalheap[i].time = flows[i].nextarrival;
+      arrivalheap[i].flow = i;
+    }
+    for (i=nflows/2 - 1; i>=0; i--)
+      arrivalsiftdown(i);
+  }
+  else
+    for (i=0; i<nflows && (i == 0 || !traffic_trace()); i++)
+      generate_next_arrival(i);  /* initialize event list, a trace deals its own */
+}
+
+/* Time-series snapshots (-timeseries): every interval of simulated time
+   one CSV or JSON line with the state reached by the events before it.
+   The file is fully buffered so that writing costs next to nothing. */
+static FILE *tsfile = NULL;
+static double tsinterval;
+static double tsnext;             /* time of the next snapshot */
+static int tsjson;
+static int tsdelivered = 0;       /* messages delivered at the previous snapshot */
+
+int timeseries_open(const char *spec)
+{
+  char name[256];
+  size_t len;
+
+  if (sscanf(spec, "%lf,%255s", &tsinterval, name) != 2 || tsinterval <= 0.0)
+    return 0;
+  tsfile = fopen(name, "w");
+  if (tsfile == NULL) {
+    printf("cannot create %s.\n", name);
+    exit(EXIT_FAILURE);
+  }
+  setvbuf(tsfile, NULL, _IOFBF, 1 << 16);
+  len = strlen(name);
+  tsjson = len > 6 && strcmp(name + len - 6, ".jsonl") == 0;
+  if (!tsjson)
+    fprintf(tsfile, "time,inflight,new_ACKs,packets_resent,messages_delivered,events,goodput\n");
+  tsnext = tsinterval;
+  return 1;
+}
+
+/* write the snapshots due at or before t */
+void timeseries(double t)
+{
+  int inflight, acks, resent, delivered, events, f;
+
+  while (tsnext <= t) {
+    inflight = acks = resent = delivered = events = 0;
+    for (f=0; f<nflows; f++) {
+      current_flow = f;
+      inflight += protocols[flows[f].protocol].A_inflight();
+      acks += flows[f].new_ACKs;
+      resent += flows[f].packets_resent;
+      delivered += flows[f].delivered;
+    }
+    for (f=0; f<nparts; f++)
+      events += parts[f].nlive;
+    if (tsjson)
+      fprintf(tsfile, "{\"time\":%.3f,\"inflight\":%d,\"new_ACKs\":%d,\"packets_resent\":%d,"
+              "\"messages_delivered\":%d,\"events\":%d,\"goodput\":%.5f}\n",
+              tsnext, inflight, acks, resent, delivered, events, (delivered - tsdelivered) / tsinterval);
+    else
+      fprintf(tsfile, "%.3f,%d,%d,%d,%d,%d,%.5f\n", tsnext, inflight, acks, resent, delivered, events,
+              (delivered - tsdelivered) / tsinterval);
+    tsdelivered = delivered;
+    tsnext += tsinterval;
+  }
+}
+
+/* What-if variants (-warmup, -variant): the run forks at the warm-up
+   time and every copy carries on from the identical warmed-up state with
+   its own loss, corruption or timer setting. */
+struct variant {
+  double loss, corrupt, timeout;    /* -1 keeps the run's value */
+};
+
+static struct variant variants[64];
+
+/* "loss=p,corrupt=p,timeout=t", every key optional */
+int parsevariant(const char *spec)
+{
+  struct variant *v = &variants[nvariants];
+  double value;
+  int len;
+
+  if (nvariants == 64)
+    return 0;
+  v->loss = v->corrupt = v->timeout = -1.0;
+  while (*spec) {
+    len = strcspn(spec, "=");
+    if (spec[len] != '=' || sscanf(spec + len + 1, "%lf", &value) != 1 || value < 0.0)
+      return 0;
+    if (len == 4 && strncmp(spec, "loss", 4) == 0 && value <= 1.0)
+      v->loss = value;
+    else if (len == 7 && strncmp(spec, "corrupt", 7) == 0 && value <= 1.0)
+      v->corrupt = value;
+    else if (len == 7 && strncmp(spec, "timeout", 7) == 0 && value > 0.0)
+      v->timeout = value;
+    else
+      return 0;
+    spec += strcspn(spec, ",");
+    if (*spec == ',')
+      spec++;
+  }
+  nvariants++;
+  return 1;
+}
+
+/* fork the variants; the original carries on unchanged */
+void forkvariants(void)
+{
+  struct variant *v;
+
+  variant = parallel_fork(nvariants);
+  if (variant == 0)
+    return;
+  v = &variants[variant - 1];
+  if (v->loss >= 0.0)
+    lossprob = v->loss;
+  if (v->corrupt >= 0.0)
+    corruptprob = v->corrupt;
+  if (v->timeout > 0.0)
+    timeout = v->timeout;
+  if (tsfile != NULL) {
+    fclose(tsfile);              /* the time series follows the original only */
+    tsfile = NULL;
+  }
+  pcap_discard();                /* and so does the capture */
+  printf("\nvariant %d, forked at time %f: loss %.4f, corruption %.4f", variant, time, lossprob, corruptprob);
+  if (timeout > 0.0)
+    printf(", timer increment %.3f", timeout);
+  printf("\n");
+}
+
+/* command line options select optional emulator features; the
+   interactive prompts in init() are unchanged */
+void usage(void)
+{
+  printf("options:\n");
+  printf("  -checksum sum|inet|crc32c   checksum used by the protocols (default sum)\n");
+  printf("  -ge p_gb,p_bg,loss_good,loss_bad[,corrupt_good,corrupt_bad]\n");
+  printf("                              Gilbert-Elliott bursty loss/corruption in both directions\n");
+  printf("  -geab SPEC, -geba SPEC      Gilbert-Elliott channel for A->B or B->A only\n");
+  printf("  -link bandwidth,delay,qlimit bottleneck link: bytes/time, propagation delay, FIFO packets\n");
+  printf("  -red min_th,max_th,max_p[,weight]  RED early drop on the link queue\n");
+  printf("  -reorder prob,maxdelay     hold packets back by up to maxdelay so later ones overtake\n");
+  printf("  -dup prob                   deliver a second copy of packets\n");
+  printf("  -fec k                      a parity packet after every k packets of A (2 <= k <= 31)\n");
+  printf("  -consumer fixed:t|exp:mean  B's application processes a message at a time for t time\n");
+  printf("                              units, or an exponential time of the mean (drain rate 1/t)\n");
+  printf("  -ber rate                   flip every bit of a packet with probability rate (replaces\n");
+  printf("                              the fixed corruption patterns)\n");
+  printf("  -flows n[,paths]            n sender/receiver pairs spread over shared paths\n");
+  printf("  -flowprotocols p1,p2,...    protocols given to flows round robin (-DMULTIPROTOCOL builds)\n");
+  printf("  -traffic uniform|poisson|cbr|onoff:on_mean,off_mean,alpha|trace:file\n");
+  printf("                              layer 5 arrival process (default uniform)\n");
+  printf("  -saturate                   backlogged sources: A gets a message whenever its window has room\n");
+  printf("  -timeseries interval,file   snapshot statistics every interval to file (.jsonl: JSON lines, else CSV)\n");
+  printf("  -pcap file                  write the packets crossing layer 3 to a pcapng file\n");
+  printf("  -warmup t                   fork the -variant copies of the run at time t\n");
+  printf("  -variant loss=p,corrupt=p,timeout=t  a copy that carries on from the warm-up with other\n");
+  printf("                              settings (keys optional, repeatable up to 64 times)\n");
+  printf("  -threads n                  partitioned engine, one partition per path, on n threads\n");
+  printf("                              (n > 1 needs a -DPARALLEL build)\n");
+  printf("  -replicate width[,min,max]  independent replications until every 95%% interval is\n");
+  printf("                              within width (a fraction) of its mean (default 3..100 runs)\n");
+  printf("  -jobs n                     replications run at once (default one per processor)\n");
+  printf("  -benchchecksum              benchmark the checksum algorithms and exit\n");
+  exit(EXIT_FAILURE);
+}
+
+/* comma separated protocol names, e.g. "gbn,sr" */
+int parseprotocols(const char *list)
+{
+  int p, len;
+
+  nflowprotocols = 0;
+  while (*list) {
+    len = strcspn(list, ",");
+    for (p=0; p<NPROTOCOLS; p++)
+      if ((int)strlen(protocols[p].name) == len && strncmp(list, protocols[p].name, len) == 0)
+        break;
+    if (p == NPROTOCOLS || nflowprotocols == 16)
+      return 0;
+    flowprotocol[nflowprotocols++] = p;
+    list += len;
+    if (*list == ',')
+      list++;
+  }
+  return nflowprotocols > 0;
+}
+
+void parseargs(int argc, char **argv)
+{
+  int i, n;
+
+  for (i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-checksum") == 0 && i+1 < argc) {
+      if (!checksum_select(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-ge") == 0 && i+1 < argc) {
+      if (!ge_configure(AtoB, argv[i+1]) || !ge_configure(BtoA, argv[i+1]))
+        usage();
+      i++;
+    }
+    else if (strcmp(argv[i], "-geab") == 0 && i+1 < argc) {
+      if (!ge_configure(AtoB, argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-geba") == 0 && i+1 < argc) {
+      if (!ge_configure(BtoA, argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-link") == 0 && i+1 < argc) {
+      if (!link_configure(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-red") == 0 && i+1 < argc) {
+      if (!red_configure(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-reorder") == 0 && i+1 < argc) {
+      if (!reorder_configure(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-dup") == 0 && i+1 < argc) {
+      if (!duplicate_configure(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-flows") == 0 && i+1 < argc) {
+      npaths = 1;
+      if (sscanf(argv[++i], "%d,%d", &nflows, &npaths) < 1 || nflows < 1 || npaths < 1)
+        usage();
+    }
+    else if (strcmp(argv[i], "-flowprotocols") == 0 && i+1 < argc) {
+      if (!parseprotocols(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-traffic") == 0 && i+1 < argc) {
+      if (!traffic_configure(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-fec") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%d", &fec) != 1 || fec < 2 || fec > 31)
+        usage();
+    }
+    else if (strcmp(argv[i], "-consumer") == 0 && i+1 < argc) {
+      i++;
+      if (strncmp(argv[i], "fixed:", 6) == 0)
+        consumer = CONSUMER_FIXED;
+      else if (strncmp(argv[i], "exp:", 4) == 0)
+        consumer = CONSUMER_EXP;
+      else
+        usage();
+      if (sscanf(strchr(argv[i], ':') + 1, "%lf", &consumertime) != 1 || consumertime <= 0.0)
+        usage();
+    }
+    else if (strcmp(argv[i], "-ber") == 0 && i+1 < argc) {
+      if (!ber_configure(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-pcap") == 0 && i+1 < argc) {
+      if (!pcap_open(argv[++i])) {
+        printf("cannot create %s.\n", argv[i]);
+        exit(EXIT_FAILURE);
+      }
+    }
+    else if (strcmp(argv[i], "-timeseries") == 0 && i+1 < argc) {
+      if (!timeseries_open(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-warmup") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%lf", &warmup) != 1 || warmup < 0.0)
+        usage();
+    }
+    else if (strcmp(argv[i], "-variant") == 0 && i+1 < argc) {
+      if (!parsevariant(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-saturate") == 0)
+      saturated = 1;
+    else if (strcmp(argv[i], "-threads") == 0 && i+1 < argc) {
+      partitioned = 1;
+      if (sscanf(argv[++i], "%d", &nthreads) != 1 || nthreads < 1)
+        usage();
+#ifndef PARALLEL
+      if (nthreads > 1)
+        usage();
+#endif
+    }
+    else if (strcmp(argv[i], "-replicate") == 0 && i+1 < argc) {
+      n = sscanf(argv[++i], "%lf,%d,%d", &repwidth, &repmin, &repmax);
+      if (n < 1 || repwidth <= 0.0 || repwidth >= 1.0 || repmin < 2 || repmax < repmin || repmax > 100000)
+        usage();
+    }
+    else if (strcmp(argv[i], "-jobs") == 0 && i+1 < argc) {
+      if (sscanf(argv[++i], "%d", &jobs) != 1 || jobs < 1 || jobs > 64)
+        usage();
+    }
+    else if (strcmp(argv[i], "-benchchecksum") == 0) {
+      checksum_benchmark();
+      exit(EXIT_SUCCESS);
+    }
+    else
+      usage();
+  }
+  if (nvariants > 0 && warmup < 0.0)
+    usage();
+  if (repwidth > 0.0 && (nvariants > 0 || tsfile != NULL || pcap_enabled())) {
+    printf("-replicate cannot be combined with -variant, -timeseries or -pcap.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (partitioned && pcap_enabled()) {
+    printf("-pcap needs the sequential engine, it cannot be combined with -threads.\n");
+    exit(EXIT_FAILURE);
+  }
 }
 
 /********************** Student-callable ROUTINES ***********************/
@@ -235,29 +1210,17 @@ void init(void)                         /* initialize the simulator */
 void stoptimer(int AorB)
 /* A or B is trying to stop timer */
 {
-  struct event *q;
+  unsigned int q;
 
   if (TRACE>1)
     printf("          STOP TIMER: stopping timer at %f\n",time);
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      /* remove this event */
-      if (q->next==NULL && q->prev==NULL)
-        evlist=NULL;         /* remove first and only event on list */
-      else if (q->next==NULL) /* end of list - there is one in front */
-        q->prev->next = NULL;
-      else if (q==evlist) { /* front of list - there must be event after */
-        q->next->prev=NULL;
-        evlist = q->next;
-      }
-      else {     /* middle of list */
-        q->next->prev = q->prev;
-        q->prev->next =  q->next;
-      }
-      free(q);
-      return;
-    }
+  q = flows[current_flow].timer[AorB];
+  if (q != NOEVENT) {
+    /* remove this event */
+    cancelevent(current_flow, q);
+    flows[current_flow].timer[AorB] = NOEVENT;
+    return;
+  }
   printf("Warning: unable to cancel your timer. It wasn't running.\n");
 }
 
@@ -266,116 +1229,396 @@ void starttimer(int AorB, double increment)
 /* A or B is trying to start timer */
 {
 
-  struct event *q;
-  struct event *evptr;
+  struct event ev;
 
   if (TRACE>1)
     printf("          START TIMER: starting timer at %f\n",time);
   /* be nice: check to see if timer is already started, if so, then  warn */
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next)  */
-  for (q=evlist; q!=NULL ; q = q->next)  
-    if ( (q->evtype==TIMER_INTERRUPT  && q->eventity==AorB) ) { 
-      printf("Warning: attempt to start a timer that is already started\n");
-      return;
-    }
+  if (flows[current_flow].timer[AorB] != NOEVENT) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
  
   /* create future event for when timer goes off */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  evptr->evtime =  time + increment;
-  evptr->evtype =  TIMER_INTERRUPT;
+  if (timeout > 0.0)
+    increment = timeout;
+  ev.evtime =  time + increment;
+  ev.evtype =  TIMER_INTERRUPT;
    
  
-  evptr->eventity = AorB;
-  insertevent(evptr);
+  ev.eventity = AorB;
+  ev.flow = current_flow;
+  flows[current_flow].timer[AorB] = insertevent(&ev);
 } 
 
 
 /************************** TOLAYER3 ***************/
+
+/* p ^= q, header and payload */
+void pktxor(struct pkt *p, const struct pkt *q)
+{
+  int i;
+
+  p->seqnum ^= q->seqnum;
+  p->acknum ^= q->acknum;
+  p->checksum ^= q->checksum;
+  for (i=0; i<20; i++)
+    p->payload[i] ^= q->payload[i];
+}
+
+/* the current time of the flow's partition */
+double get_sim_time(void)
+{
+  return time;
+}
+
+void transmit(int AorB, struct pkt packet, int fecblock, int fecindex);
+
 void tolayer3(int AorB, struct pkt packet)
 /* A or B is sending to network  */
 {
-  struct pkt *mypktptr;
-  struct event *evptr,*q;
-  float lastime, x;
-  int i;
+  struct fecstate *f = flows[current_flow].fec;
+  struct pkt parity;
+
+  if (f == NULL || AorB != A) {
+    transmit(AorB, packet, -1, -1);
+    return;
+  }
+  pktxor(&f->parity, &packet);
+  transmit(A, packet, f->block, f->n);
+  if (++f->n == fec) {
+    parity = f->parity;
+    if (TRACE>0)
+      printf("          TOLAYER3: FEC parity packet of block %d\n", f->block);
+    f->parities++;
+    transmit(A, parity, f->block, fec);
+    memset(&f->parity, 0, sizeof(struct pkt));
+    f->block++;
+    f->n = 0;
+  }
+}
+
+/* send packet into the channel with its FEC tags */
+void transmit(int AorB, struct pkt packet, int fecblock, int fecindex)
+{
+  struct event ev;
+  struct flow *fl = &flows[current_flow];
+  simtime lastime;
+  float x;
+  int i, lost, corrupt, outoforder;
+  int chan = fl->path*2 + AorB;  /* the shared path, in this direction */
+  double linkarrival = 0.0, holdback;
 
   ntolayer3++;
+  if (AorB == A)
+    fl->packets++;
+
+  /* queue on the bottleneck link, overflow is not counted as random loss */
+  if (link_enabled()) {
+    linkarrival = link_send(chan, time);
+    if (linkarrival < 0.0) {
+      if (TRACE>0)
+        printf("          TOLAYER3: packet dropped by full link queue\n");
+      if (pcap_enabled())
+        pcap_packet(time, current_flow, fl->path, AorB, 0, &packet, "dropped by full link queue");
+      return;
+    }
+  }
 
   /* simulate losses: */
-  if (jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+  if (ge_enabled(chan))
+    lost = ge_lost(chan);
+  else
+    lost = jimsrand() < lossprob && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B));
+  channel_count_loss(chan, lost);
+  if (lost) {
     nlost++;
     if (TRACE>0)    
       printf("          TOLAYER3: packet being lost\n");
+    if (pcap_enabled())
+      pcap_packet(time, current_flow, fl->path, AorB, 0, &packet, "lost");
     return;
   }  
 
   /* make a copy of the packet student just gave me since he/she may decide */
   /* to do something with the packet after we return back to him/her */ 
-  mypktptr = malloc(sizeof(struct pkt));
-  if (mypktptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  mypktptr->seqnum = packet.seqnum;
-  mypktptr->acknum = packet.acknum;
-  mypktptr->checksum = packet.checksum;
+  ev.pkt.seqnum = packet.seqnum;
+  ev.pkt.acknum = packet.acknum;
+  ev.pkt.checksum = packet.checksum;
   for (i=0; i<20; i++)
-    mypktptr->payload[i] = packet.payload[i];
+    ev.pkt.payload[i] = packet.payload[i];
   if (TRACE>2)  {
-    printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
-           mypktptr->acknum,  mypktptr->checksum);
+    printf("          TOLAYER3: seq: %d, ack %d, check: %d ", ev.pkt.seqnum,
+           ev.pkt.acknum,  ev.pkt.checksum);
     for (i=0; i<20; i++)
-      printf("%c",mypktptr->payload[i]);
+      printf("%c",ev.pkt.payload[i]);
     printf("\n");
   }
 
   /* create future event for arrival of packet at the other side */
-  evptr = malloc(sizeof(struct event));
-  if (evptr == 0) {
-    printf("memory allocation for event failed.");
-    exit(EXIT_FAILURE);
-  }
-  evptr->evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
-  evptr->eventity = (AorB+1) % 2; /* event occurs at other entity */
-  evptr->pktptr = mypktptr;       /* save ptr to my copy of packet */
+  ev.evtype =  FROM_LAYER3;   /* packet will pop out from layer3 */
+  ev.fecblock = fecblock;
+  ev.fecindex = fecindex;
+  ev.eventity = (AorB+1) % 2; /* event occurs at other entity */
+  ev.flow = current_flow;     /* of the same flow */
+  ev.sendseq = channel_sendseq(chan);
   /* finally, compute the arrival time of packet at the other end.
-     medium can not reorder, so make sure packet arrives between 1 and 10
-     time units after the latest arrival time of packets
-     currently in the medium on their way to the destination */
-  lastime = time;
-  /* for (q=evlist; q!=NULL && q->next!=NULL; q = q->next) */
-  for (q=evlist; q!=NULL ; q = q->next) 
-    if ( (q->evtype==FROM_LAYER3  && q->eventity==evptr->eventity) ) 
-      lastime = q->evtime;
-  evptr->evtime =  lastime + 1 + 9*jimsrand();
+     medium does not reorder unless asked to, so make sure packet arrives
+     between 1 and 10 time units after the latest arrival time of packets
+     currently in the medium on their way to the destination.  Packets
+     held back by the reordering channel do not delay the ones behind them */
+  if (link_enabled())
+    ev.evtime = linkarrival;   /* FIFO link: serialization + propagation */
+  else {
+    lastime = time;
+    if (fl->lastarrival[ev.eventity] > lastime)
+      lastime = fl->lastarrival[ev.eventity];
+    ev.evtime =  lastime + 1 + 9*jimsrand();
+  }
+  holdback = reorder_delay(chan);
+  outoforder = (holdback > 0.0);
+  ev.evtime += holdback;
+  if (!outoforder && ev.evtime > fl->lastarrival[ev.eventity])
+    fl->lastarrival[ev.eventity] = ev.evtime;
  
 
 
-  /* simulate corruption: */
-  if ((jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B))) {
+  /* simulate corruption: bit errors anywhere in the packet, or one of
+     three fixed patterns */
+  if (ber_enabled())
+    corrupt = ber_corrupt(chan, &ev.pkt) > 0;
+  else if (ge_enabled(chan))
+    corrupt = ge_corrupt(chan);
+  else
+    corrupt = (jimsrand() < corruptprob)  && (!(AorB == B && corruptdirection == A) && !(AorB == A && corruptdirection == B));
+  ev.corrupt = corrupt;
+  if (corrupt) {
     ncorrupt++;
-    if ( (x = jimsrand()) < .75)
-      mypktptr->payload[0]='Z';   /* corrupt payload */
-    else if (x < .875)
-      mypktptr->seqnum = 999999;
-    else
-      mypktptr->acknum = 999999;
+    if (!ber_enabled()) {       /* else the bits are already flipped */
+      if ( (x = jimsrand()) < .75)
+        ev.pkt.payload[0]='Z';   /* corrupt payload */
+      else if (x < .875)
+        ev.pkt.seqnum = 999999;
+      else
+        ev.pkt.acknum = 999999;
+    }
     if (TRACE>0)    
       printf("          TOLAYER3: packet being corrupted\n");
   }  
 
+  if (pcap_enabled())
+    pcap_packet(time, current_flow, fl->path, AorB, 0, &packet, corrupt ? "corrupted" : NULL);
+
   if (TRACE>2)  
     printf("          TOLAYER3: scheduling arrival on other side\n");
-  insertevent(evptr);
+  insertevent(&ev);
+
+  /* simulate duplication: a copy follows the original through the medium */
+  if (duplicate(chan)) {
+    if (link_enabled()) {
+      linkarrival = link_send(chan, time);
+      if (linkarrival < 0.0)
+        return;
+    }
+    ev.sendseq = -1;
+    if (link_enabled())
+      ev.evtime = linkarrival;
+    else
+      ev.evtime += 1 + 9*jimsrand();
+    if (!outoforder && ev.evtime > fl->lastarrival[ev.eventity])
+      fl->lastarrival[ev.eventity] = ev.evtime;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being duplicated\n");
+    insertevent(&ev);
+  }
 } 
 
-void tolayer5(int AorB, char datasent[20])
+/* whether two packets of the block received so far, the rebuilt one
+   included, carry the same sequence number.  Such a block holds resends,
+   and B may have taken a copy and moved round its sequence space since,
+   so handing it a rebuilt older copy could pass it off as a new one. */
+int seqrepeats(const struct fecstate *f)
+{
+  int i, j;
+
+  for (i=0; i<fec; i++)
+    for (j=i+1; j<fec; j++)
+      if ((f->have >> i) & 1 && (f->have >> j) & 1 && f->held[i].seqnum == f->held[j].seqnum)
+        return 1;
+  return 0;
+}
+
+/* whether B has lately been given a copy of packet p */
+int fecseen(const struct fecstate *f, const struct pkt *p)
+{
+  int i;
+
+  for (i=0; i<f->nseen; i++)
+    if (f->seen[i].seqnum == p->seqnum && f->seen[i].checksum == p->checksum)
+      return 1;
+  return 0;
+}
+
+/* pass packet p to B, and remember it */
+void fecpass(struct fecstate *f, struct protocol *proto, struct pkt p)
+{
+  f->lastseen = (f->lastseen + 1) % FECSEEN;
+  f->seen[f->lastseen].seqnum = p.seqnum;
+  f->seen[f->lastseen].checksum = p.checksum;
+  if (f->nseen < FECSEEN)
+    f->nseen++;
+  proto->B_input(p);
+}
+
+/* A packet of A arriving at B's FEC layer, which passes it on to B */
+void fecreceive(struct fecstate *f, struct protocol *proto, const struct event *e)
+{
+  int i, missing;
+
+  if (e->fecindex < fec && !e->corrupt)
+    for (i=0; i<f->nrebuilt; i++)
+      if (f->rebuilt[i].seqnum == e->pkt.seqnum && f->rebuilt[i].checksum == e->pkt.checksum) {
+        f->saved += time - f->rebuilt[i].time;
+        f->nsaved++;
+        f->rebuilt[i] = f->rebuilt[--f->nrebuilt];
+        break;
+      }
+
+  if (e->fecblock > f->decblock) {
+    if (f->nhave < fec)
+      f->failed++;
+    f->decblock = e->fecblock;
+    f->have = 0;
+    f->nhave = 0;
+    memset(&f->sum, 0, sizeof(struct pkt));
+    for (i=0; i<f->nrebuilt; )
+      if (f->rebuilt[i].block < f->decblock - FECHORIZON)
+        f->rebuilt[i] = f->rebuilt[--f->nrebuilt];
+      else
+        i++;
+  }
+  if (e->fecindex < fec && e->corrupt)
+    proto->B_input(e->pkt);
+  else if (e->fecindex < fec)
+    fecpass(f, proto, e->pkt);
+  if (e->fecblock != f->decblock || f->nhave >= fec || e->corrupt || (f->have >> e->fecindex) & 1)
+    return;  /* not for the decoder: an old or finished block, a copy, corrupted */
+  f->have |= 1UL << e->fecindex;
+  f->nhave++;
+  pktxor(&f->sum, &e->pkt);
+  if (e->fecindex < fec)
+    f->held[e->fecindex] = e->pkt;
+  if (f->nhave < fec)
+    return;
+
+  for (missing = 0; (f->have >> missing) & 1; missing++)
+    ;
+  if (missing == fec)
+    return;  /* only the parity was missing */
+  f->have |= 1UL << missing;
+  f->nhave++;
+  f->held[missing] = f->sum;
+  if (seqrepeats(f) || fecseen(f, &f->sum)) {
+    f->unsafe++;
+    return;
+  }
+  f->recovered++;
+  if (TRACE>0)
+    printf("          FEC: packet %d rebuilt\n", f->sum.seqnum);
+  if (f->nrebuilt == FECREBUILT)
+    f->nrebuilt--;
+  f->rebuilt[f->nrebuilt].seqnum = f->sum.seqnum;
+  f->rebuilt[f->nrebuilt].checksum = f->sum.checksum;
+  f->rebuilt[f->nrebuilt].block = f->decblock;
+  f->rebuilt[f->nrebuilt].time = time;
+  f->nrebuilt++;
+  fecpass(f, proto, f->sum);
+}
+
+/* A took a message into its window: note the time for its latency */
+void msgtaken(struct flow *fl)
+{
+  simtime *ring;
+  int i;
+
+  if (fl->ntaken == fl->takensize) {
+    ring = malloc((fl->takensize ? 2 * fl->takensize : 64) * sizeof(simtime));
+    if (ring == 0) {
+      printf("memory allocation for message times failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (i=0; i<fl->ntaken; i++)
+      ring[i] = fl->taken[(fl->firsttaken + i) % fl->takensize];
+    free(fl->taken);
+    fl->taken = ring;
+    fl->firsttaken = 0;
+    fl->takensize = fl->takensize ? 2 * fl->takensize : 64;
+  }
+  fl->taken[(fl->firsttaken + fl->ntaken) % fl->takensize] = time;
+  fl->ntaken++;
+}
+
+/* B's application takes a message: busy until an APP_READY event */
+void consume(struct flow *fl)
+{
+  struct event ev;
+  double t = consumertime;
+
+  if (consumer == CONSUMER_EXP) {
+    t = 1.0 - jimsrand();
+    if (t < 1e-12)
+      t = 1e-12;
+    t = -consumertime * log(t);
+  }
+  fl->appbusy = 1;
+  fl->appbusytime += t;
+  ev.evtime = time + t;
+  ev.evtype = APP_READY;
+  ev.eventity = B;
+  ev.flow = current_flow;
+  insertevent(&ev);
+}
+
+/* messages the application of A or B takes now */
+int tolayer5_room(int AorB)
+{
+  if (AorB == A || consumer == CONSUMER_NONE)
+    return INT_MAX;
+  return !flows[current_flow].appbusy;
+}
+
+/* whether layer 5 of A or B has a message waiting behind the one it is
+   handing over: a saturated source until its quota is used up, else the
+   rest of an arrival of several messages */
+int layer5_waiting(int AorB)
+{
+  struct flow *fl = &flows[current_flow];
+
+  if (AorB == B)
+    return 0;
+  if (saturated)
+    return fl->generated < fl->quota;
+  return fl->waiting;
+}
+
+/* one message reaches the application */
+void deliver(struct flow *fl, int AorB, const char *datasent)
 {
   int i;  
+
+  if (AorB == B && consumer != CONSUMER_NONE) {
+    if (fl->appbusy) {
+      if (TRACE>2)
+        printf("          TOLAYER5: application at B is busy, message lost\n");
+      fl->overruns++;
+      if (fl->ntaken > 0) {
+        fl->firsttaken = (fl->firsttaken + 1) % fl->takensize;
+        fl->ntaken--;
+      }
+      return;
+    }
+    consume(fl);
+  }
   if (TRACE>2) {
     printf("          TOLAYER5: data received by application at ");
     if (AorB == A) 
@@ -387,44 +1630,313 @@ void tolayer5(int AorB, char datasent[20])
     printf("\n");
   }
   messages_delivered++;
+  fl->delivered++;
+  fl->lastdelivery = time;
+  if (AorB == B && fl->ntaken > 0) {   /* in order, so the oldest one taken */
+    fl->latency += time - fl->taken[fl->firsttaken];
+    fl->firsttaken = (fl->firsttaken + 1) % fl->takensize;
+    fl->ntaken--;
+  }
+}
+
+/* one delivery callback of batch messages */
+void countbatch(struct flow *fl, int batch)
+{
+  fl->deliveries++;
+  if (batch > fl->largestbatch)
+    fl->largestbatch = batch;
 }
 
-int main(void)
+void tolayer5(int AorB, char datasent[20])
+{
+  struct flow *fl = &flows[current_flow];
+
+  deliver(fl, AorB, datasent);
+  countbatch(fl, 1);
+}
+
+void tolayer5v(int AorB, const struct msgspan *spans, int nspans)
+{
+  struct flow *fl = &flows[current_flow];
+  int i, k, batch = 0;
+
+  for (i=0; i<nspans; i++)
+    for (k=0; k<spans[i].count; k++)
+      deliver(fl, AorB, spans[i].base + k * spans[i].stride);
+  for (i=0; i<nspans; i++)
+    batch += spans[i].count;
+  if (batch > 0)
+    countbatch(fl, batch);
+}
+
+/* per-flow results and Jain's fairness index over the flows' goodput */
+void flowreport(void)
+{
+  struct flow *fl;
+  double goodput, sum = 0.0, sumsq = 0.0;
+  int f;
+
+  printf("per-flow statistics (%d flows over %d paths):\n", nflows, npaths);
+  printf("  %6s %8s %5s %9s %8s %8s %11s %9s %9s\n", "flow", "protocol", "path", "generated",
+         "packets", "resent", "window_full", "delivered", "goodput");
+  for (f=0; f<nflows; f++) {
+    fl = &flows[f];
+    goodput = time > 0.0 ? fl->delivered / time : 0.0;
+    sum += goodput;
+    sumsq += goodput * goodput;
+    printf("  %6d %8s %5d %9d %8d %8d %11d %9d %9.5f\n", f, protocols[fl->protocol].name, fl->path,
+           fl->generated, fl->packets, fl->packets_resent, fl->window_full, fl->delivered, goodput);
+  }
+  printf("Jain's fairness index over goodput:  %.4f \n", sumsq > 0.0 ? sum * sum / (nflows * sumsq) : 1.0);
+}
+
+/* corrupted packets that got past the checksum, per protocol */
+void undetectedreport(void)
+{
+  int p, f, arrivals, undetected, used;
+
+  for (p=0; p<NPROTOCOLS; p++) {
+    arrivals = undetected = used = 0;
+    for (f=0; f<nflows; f++)
+      if (flows[f].protocol == p) {
+        used = 1;
+        arrivals += flows[f].corruptarrivals;
+        undetected += flows[f].undetected;
+      }
+    if (!used)
+      continue;
+    if (NPROTOCOLS > 1)
+      printf("%s: ", protocols[p].name);
+    printf("corrupted packets the checksum did not detect:  %d of %d that arrived \n",
+           undetected, arrivals);
+  }
+}
+
+/* what the parity packets cost and what they saved */
+void fecreport(void)
+{
+  struct fecstate *f;
+  double saved = 0.0, latency = 0.0;
+  int parities = 0, recovered = 0, failed = 0, unsafe = 0, nsaved = 0, delivered = 0, i;
+
+  for (i=0; i<nflows; i++) {
+    f = flows[i].fec;
+    parities += f->parities;
+    recovered += f->recovered;
+    failed += f->failed;
+    unsafe += f->unsafe;
+    saved += f->saved;
+    nsaved += f->nsaved;
+    latency += flows[i].latency;
+    delivered += flows[i].delivered;
+  }
+  printf("FEC: a parity packet after every %d packets of A (code rate %.3f), %d parity packets sent\n",
+         fec, (double)fec / (fec + 1), parities);
+  printf("  packets rebuilt at B:  %d, withheld as copies B may have had:  %d, blocks that lost more than one packet:  %d\n",
+         recovered, unsafe, failed);
+  printf("  rebuilt packets resent by A later:  %d, arriving on average %.3f after the rebuild\n",
+         nsaved, nsaved ? saved / nsaved : 0.0);
+  printf("  mean message latency:  %.3f\n", delivered ? latency / delivered : 0.0);
+}
+
+/* how busy the slow application at B was and what never reached it */
+void consumerreport(void)
+{
+  double busy = 0.0;
+  int overruns = 0, undelivered = 0, delivered = 0, f;
+
+  for (f=0; f<nflows; f++) {
+    busy += flows[f].appbusytime;
+    overruns += flows[f].overruns;
+    undelivered += flows[f].ntaken;
+    delivered += flows[f].delivered;
+  }
+  printf("application at B: %s processing time %.3f per message, busy %.1f%% of the time \n",
+         consumer == CONSUMER_EXP ? "exponential" : "fixed", consumertime,
+         time > 0.0 ? 100.0 * busy / (nflows * time) : 0.0);
+  printf("  messages it took:  %d, lost arriving while it was busy:  %d, taken by A and never delivered:  %d \n",
+         delivered, overruns, undelivered);
+}
+
+/* the windows A ended the run with, sized automatically in a
+   -DAUTOWINDOW build of Go-Back-N, and the goodput they gave */
+void windowreport(void)
+{
+  struct flow *fl;
+  int p, f, w, n, sum, least, most, delivered;
+
+  for (p=0; p<NPROTOCOLS; p++) {
+    n = sum = most = delivered = 0;
+    least = -1;
+    for (f=0; f<nflows; f++)
+      if (flows[f].protocol == p) {
+        fl = &flows[f];
+        current_flow = f;
+        w = protocols[p].A_window();
+        n++;
+        sum += w;
+        if (least < 0 || w < least)
+          least = w;
+        if (w > most)
+          most = w;
+        delivered += fl->delivered;
+      }
+    if (n == 0)
+      continue;
+    if (NPROTOCOLS > 1)
+      printf("%s: ", protocols[p].name);
+    printf("window of A at the end:  %.2f (least %d, most %d over %d flows), goodput %.5f messages/time \n",
+           (double)sum / n, least, most, n, time > 0.0 ? delivered / time : 0.0);
+  }
+}
+
+/* backlogged sources: goodput up to the last delivery and how much of
+   the channel it took */
+void saturationreport(void)
+{
+  struct flow *fl;
+  double done = 0.0, goodput;
+  int delivered = 0, packets = 0, complete = 1, p, deliveries = 0, largestbatch = 0;
+
+  for (fl = flows; fl < flows + nflows; fl++) {
+    delivered += fl->delivered;
+    packets += fl->packets;
+    deliveries += fl->deliveries;
+    if (fl->largestbatch > largestbatch)
+      largestbatch = fl->largestbatch;
+    if (fl->delivered < fl->quota)
+      complete = 0;
+    if (fl->lastdelivery > done)
+      done = fl->lastdelivery;
+  }
+  goodput = done > 0.0 ? delivered / done : 0.0;
+  printf("saturated sources: %d of %d messages delivered, %s at time %f \n", delivered, nsim,
+         complete ? "completed" : repstalled ? "stalled, last delivery" : "last delivery", done);
+  printf("  sustained goodput:  %.5f messages/time (%.3f payload bytes/time) \n", goodput, 20.0 * goodput);
+  printf("  packets sent by A per message delivered:  %.3f \n", delivered ? (double)packets / delivered : 0.0);
+  printf("  deliveries to the application:  %d calls, %.2f messages per call, at most %d \n", deliveries,
+         deliveries ? (double)delivered / deliveries : 0.0, largestbatch);
+  if (link_enabled())
+    for (p=0; p<npaths; p++)
+      printf("  A->B link utilization, path %d:  %.1f%% \n", p, 100.0 * link_utilization(p*2 + AtoB, done));
+}
+
+/* a replication's metrics for the driver: goodput (up to the last
+   delivery of saturated sources), mean latency from A taking a message to
+   its delivery, and resends */
+void replicationresult(void)
+{
+  struct flow *fl;
+  double v[NMETRICS + 1], latency = 0.0, end = time;
+  int delivered = 0;
+
+  if (saturated)
+    for (end = 0.0, fl = flows; fl < flows + nflows; fl++)
+      if (fl->lastdelivery > end)
+        end = fl->lastdelivery;
+  for (fl = flows; fl < flows + nflows; fl++) {
+    latency += fl->latency;
+    delivered += fl->delivered;
+  }
+  v[0] = end > 0.0 ? messages_delivered / end : 0.0;
+  v[1] = delivered ? latency / delivered : 0.0;
+  v[2] = packets_resent;
+  v[3] = repstalled;
+  parallel_result(v, NMETRICS + 1);
+}
+
+/* whether the run stalled: its protocol has delivered nothing for
+   stallgap although no more messages are coming from layer 5, the mark
+   of a sender and receiver that no longer agree, and the run ends there
+   instead of resending forever.  Looks at the flows once per stallgap
+   at most. */
+int stalled(double now)
+{
+  struct flow *fl;
+  double progress = 0.0;
+
+  if (now < stallcheck)
+    return 0;
+  for (fl = flows; fl < flows + nflows; fl++)
+    if (fl->lastdelivery > progress)
+      progress = fl->lastdelivery;
+  if (!saturated && nsim < nsimmax)
+    progress = now;
+  if (now - progress > stallgap)
+    return repstalled = 1;
+  stallcheck = progress + stallgap;
+  return 0;
+}
+
+/* hand a backlogged source's A messages for as long as its window takes them */
+void saturate(struct flow *fl, struct protocol *proto)
+{
+  struct msg msg2give;
+  int i;
+
+  while (fl->generated < fl->quota && proto->A_ready()) {
+    for (i=0; i<20; i++)
+      msg2give.data[i] = 97 + fl->generated % 26;
+    if (TRACE>2) {
+      printf("          MAINLOOP: data given to student: ");
+      for (i=0; i<20; i++)
+        printf("%c", msg2give.data[i]);
+      printf("\n");
+    }
+    fl->generated++;
+    proto->A_output(msg2give);
+    msgtaken(fl);
+  }
+}
+
+/* run one event of the flow it belongs to */
+void runevent(struct event *eventptr)
 {
-  struct event *eventptr;
   struct msg  msg2give;
   struct pkt  pkt2give;
-   
-  int i,j;
-  
-  init();
-  A_init();
-  B_init();
-   
-  while (1) {
-    eventptr = evlist;            /* get next event to simulate */
-    if (eventptr==NULL)
-      goto terminate;
-    evlist = evlist->next;        /* remove this event from event list */
-    if (evlist!=NULL)
-      evlist->prev=NULL;
-    if (TRACE>=2) {
-      printf("\nEVENT time: %f,",eventptr->evtime);
-      printf("  type: %d",eventptr->evtype);
-      if (eventptr->evtype==0)
-        printf(", timerinterrupt  ");
-      else if (eventptr->evtype==1)
-        printf(", fromlayer5 ");
-      else
-        printf(", fromlayer3 ");
-      printf(" entity: %d\n",eventptr->eventity);
-    }
-    time = eventptr->evtime;        /* update time to next event time */
-    if (eventptr->evtype == FROM_LAYER5 ) {
-      if (nsim < nsimmax) {
-        generate_next_arrival();   /* set up future arrival */
+  struct flow *fl;
+  struct protocol *proto;
+  int saved_window_full, saved_packets_resent, saved_new_ACKs, saved_packets_received;
+  int i,j,k,full;
+
+  if (TRACE>=2) {
+    printf("\nEVENT time: %f,",eventptr->evtime);
+    printf("  type: %d",eventptr->evtype);
+    if (eventptr->evtype==0)
+      printf(", timerinterrupt  ");
+    else if (eventptr->evtype==1)
+      printf(", fromlayer5 ");
+    else if (eventptr->evtype==APP_READY)
+      printf(", appready ");
+    else
+      printf(", fromlayer3 ");
+    printf(" entity: %d",eventptr->eventity);
+    if (nflows > 1)
+      printf(" flow: %d",eventptr->flow);
+    printf("\n");
+  }
+  time = eventptr->evtime;        /* update time to next event time */
+  current_flow = eventptr->flow;  /* and run that flow's entities */
+  fl = &flows[current_flow];
+  proto = &protocols[fl->protocol];
+  saved_window_full = window_full;
+  saved_packets_resent = packets_resent;
+  saved_new_ACKs = new_ACKs;
+  saved_packets_received = packets_received;
+  if (eventptr->evtype == FROM_LAYER5 && saturated) {
+    /* a backlogged source starts, saturate() below fills its window */
+  }
+  else if (eventptr->evtype == FROM_LAYER5 ) {
+    if (partitioned || nsim < nsimmax) {
+      if (!partitioned)
+        generate_next_arrival(current_flow);   /* set up future arrival */
+      /* an arrival larger than a msg is handed over as several */
+      for (k=0; k<eventptr->nmsgs && (partitioned || nsim < nsimmax); k++) {
+        if (partitioned)
+          j = (eventptr->msgnum + k) % 26;   /* numbered when it was handed out */
+        else
+          j = nsim++ % 26;
         /* fill in msg to give with string of same letter */    
-        j = nsim % 26; 
         for (i=0; i<20; i++)  
           msg2give.data[i] = 97 + j;
         if (TRACE>2) {
@@ -433,46 +1945,211 @@ int main(void)
             printf("%c", msg2give.data[i]);
           printf("\n");
         }
-        nsim++;
-        if (eventptr->eventity == A) 
-          A_output(msg2give);  
+        fl->generated++;
+        if (eventptr->eventity == A) {
+          full = window_full;
+          fl->waiting = k+1 < eventptr->nmsgs && (partitioned || nsim < nsimmax);
+          proto->A_output(msg2give);  
+          fl->waiting = 0;
+          if (window_full == full)
+            msgtaken(fl);
+        }
         else
-          B_output(msg2give);  
+          proto->B_output(msg2give);  
       }
-      else if (TRACE > 2)
-          printf("          FROM_LAYER5: no more messages to send: \n");
-    }
-    else if (eventptr->evtype ==  FROM_LAYER3) {
-      pkt2give.seqnum = eventptr->pktptr->seqnum;
-      pkt2give.acknum = eventptr->pktptr->acknum;
-      pkt2give.checksum = eventptr->pktptr->checksum;
-      for (i=0; i<20; i++)  
-        pkt2give.payload[i] = eventptr->pktptr->payload[i];
-	    if (eventptr->eventity ==A)      /* deliver packet by calling */
-        A_input(pkt2give);            /* appropriate entity */
-      else
-        B_input(pkt2give);
-	    free(eventptr->pktptr);          /* free the memory for packet */
     }
-    else if (eventptr->evtype ==  TIMER_INTERRUPT) {
-      if (eventptr->eventity == A) 
-        A_timerinterrupt();
-      else
-        B_timerinterrupt();
+    else if (TRACE > 2)
+        printf("          FROM_LAYER5: no more messages to send: \n");
+  }
+  else if (eventptr->evtype ==  FROM_LAYER3) {
+    pkt2give = eventptr->pkt;
+    if (eventptr->corrupt && eventptr->fecindex != fec) {
+      fl->corruptarrivals++;
+      if (pkt_checksum(&pkt2give) == pkt2give.checksum)
+        fl->undetected++;
     }
-    else  {
-      printf("INTERNAL PANIC: unknown event type \n");
+    if (pcap_enabled())
+      pcap_packet(time, eventptr->flow, fl->path, (eventptr->eventity+1) % 2, 1, &pkt2give,
+                  eventptr->sendseq < 0 ? (eventptr->corrupt ? "corrupted duplicate" : "duplicate")
+                  : (eventptr->corrupt ? "corrupted" : NULL));
+    if (eventptr->sendseq >= 0)
+      channel_count_arrival(fl->path*2 + (eventptr->eventity+1) % 2, eventptr->sendseq);
+    if (eventptr->fecindex >= 0)
+      fecreceive(fl->fec, proto, eventptr);
+    else if (eventptr->eventity ==A)      /* deliver packet by calling */
+      proto->A_input(pkt2give);            /* appropriate entity */
+    else
+      proto->B_input(pkt2give);
+  }
+  else if (eventptr->evtype ==  TIMER_INTERRUPT) {
+    fl->timer[eventptr->eventity] = NOEVENT;
+    if (eventptr->eventity == A) 
+      proto->A_timerinterrupt();
+    else
+      proto->B_timerinterrupt();
+  }
+  else if (eventptr->evtype ==  APP_READY) {
+    fl->appbusy = 0;
+    proto->B_appready();
+  }
+  else  {
+    printf("INTERNAL PANIC: unknown event type \n");
+  }
+  if (saturated)
+    saturate(fl, proto);
+  fl->window_full += window_full - saved_window_full;
+  fl->packets_resent += packets_resent - saved_packets_resent;
+  fl->new_ACKs += new_ACKs - saved_new_ACKs;
+  fl->packets_received += packets_received - saved_packets_received;
+}
+
+/******************** PARTITIONED ENGINE *********************
+   Flows only meet on the path they share, so every path is a partition
+   that no other partition sends events to.  The engine advances them all
+   in windows one channel lookahead long, the least time a packet spends
+   in the medium.  Before a window starts, the messages arriving in it are
+   numbered in time order over all flows and handed to their partitions;
+   then every partition runs its events up to the end of the window, the
+   partitions spread over -threads threads.  Each partition draws from its
+   own random streams, so the results do not depend on the number of
+   threads, and -threads 1 is their sequential reference.
+*************************************************************/
+static double windowend;
+
+/* run the events before windowend of the partitions given to thread */
+void runwindow(int thread)
+{
+  struct partition *q;
+  struct event ev;
+  int p;
+
+  for (p = thread; p < nparts; p += nthreads) {
+    q = &parts[p];
+    rngstream = &q->rng;
+    while (q->nevents > 0 && q->evheap[0].time < windowend) {
+      popevent(q, &ev);
+      runevent(&ev);
+      q->time = time;
+    }
+  }
+  rngstream = NULL;
+}
+
+void runpartitions(void)
+{
+  double lookahead = channel_lookahead(), start = 0.0, next = 0.0;
+  struct flow *fl;
+  int p, pending;
+
+  parallel_start(nthreads, runwindow);
+
+  for (;;) {
+    /* skip idle time: the window starts at the earliest pending event */
+    pending = !saturated && nsim < nsimmax;
+    if (pending)
+      next = arrivalheap[0].time;
+    for (p=0; p<nparts; p++)
+      if (parts[p].nevents > 0 && (!pending || parts[p].evheap[0].time < next)) {
+        next = parts[p].evheap[0].time;
+        pending = 1;
+      }
+    if (!pending)
+      break;
+    if (next > start)
+      start = next;
+    if (stalled(start))
+      break;
+    windowend = start + lookahead;
+    if (tsfile != NULL) {
+      timeseries(start);       /* windows end at snapshots so they see no later event */
+      if (windowend > tsnext)
+        windowend = tsnext;
     }
-    free(eventptr);
+    injectarrivals(windowend);
+    parallel_round();
+    start = windowend;
   }
+  parallel_stop();
+
+  /* the clock and the statistics were kept per thread */
+  time = 0.0;
+  for (p=0; p<nparts; p++)
+    if (parts[p].time > time)
+      time = parts[p].time;
+  window_full = packets_resent = new_ACKs = packets_received = messages_delivered = 0;
+  for (fl = flows; fl < flows + nflows; fl++) {
+    window_full += fl->window_full;
+    packets_resent += fl->packets_resent;
+    new_ACKs += fl->new_ACKs;
+    packets_received += fl->packets_received;
+    messages_delivered += fl->delivered;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct event ev;
+  int i;
+  
+  parseargs(argc, argv);
+  init();
+  for (i=0; i<nflows; i++) {
+    current_flow = i;
+    protocols[flows[i].protocol].A_init();
+    protocols[flows[i].protocol].B_init();
+  }
+   
+  if (partitioned)
+    runpartitions();
+  else
+    while (popevent(&parts[0], &ev)) {   /* get next event to simulate */
+      if (stalled(ev.evtime))
+        break;
+      if (tsfile != NULL)
+        timeseries(ev.evtime);
+      if (nvariants > 0 && warmup >= 0.0 && ev.evtime >= warmup) {
+        warmup = -1.0;
+        forkvariants();
+      }
+      runevent(&ev);
+    }
+  if (tsfile != NULL)
+    fclose(tsfile);
+  pcap_close();
+  if (saturated)
+    for (i=0; i<nflows; i++)
+      nsim += flows[i].generated;
+  if (replication >= 0)
+    replicationresult();
 
- terminate:
   printf(" Simulator terminated at time %f\n after attempting to send %d msgs from layer5\n",time,nsim);
+  if (repstalled)
+    printf("stalled: nothing was delivered for %.0f time units, the run was ended\n", stallgap);
   printf("number of messages dropped due to full window:  %d \n", window_full);
   printf("number of valid (not corrupt or duplicate) acknowledgements received at A:  %d \n", new_ACKs);
   printf("(note: a single acknowledgement may have acknowledged more than one packet - if cumulative acknowledgements are used)\n");
   printf("number of packet resends by A:  %d \n", packets_resent);
   printf("number of correct packets received at B:  %d \n", packets_received);
   printf("number of messages delivered to application:  %d \n", messages_delivered);
+  if (checksum_type != CHECKSUM_SUM)
+    printf("checksum algorithm:  %s \n", checksum_name());
+  if (ber_enabled() || checksum_type != CHECKSUM_SUM)
+    undetectedreport();
+  if (fec > 0)
+    fecreport();
+#ifdef AUTOWINDOW
+  windowreport();
+#endif
+  if (consumer != CONSUMER_NONE)
+    consumerreport();
+  if (saturated)
+    saturationreport();
+  channel_report(time);
+  if (nflows > 1)
+    flowreport();
+  if (nvariants > 0 && warmup >= 0.0)
+    printf("no variants were run: the simulation ended before the warm-up time\n");
+  if (variant == 0)
+    parallel_join();
   return EXIT_SUCCESS;
 }
\ No newline at end of file
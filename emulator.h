@@ -1,15 +1,39 @@
 extern int TRACE;
 
+/* a -DPARALLEL build runs partitions of the flows on several threads;
+   the variables the protocol shares with the emulator are then private
+   to each thread */
+#ifdef PARALLEL
+#define THREADLOCAL __thread
+#else
+#define THREADLOCAL
+#endif
+
+/* Simulated time.  Single precision runs out past about 10^6 time units,
+   where the 1-10 unit channel delays and the timer increments start to
+   round away, so time is kept in double.  A -DFLOATTIME build keeps the
+   float of the original emulator to reproduce its results exactly. */
+#ifdef FLOATTIME
+typedef float simtime;
+#else
+typedef double simtime;
+#endif
+
 /* statistics updated by GBN */
-extern int total_ACKs_received;
-extern int packets_resent;       /* count of the number of packets resent  */
-extern int new_ACKs;      /* count of the number of acks correctly received */
-extern int packets_received;  /* count of the packets received by receiver */
-extern int window_full; /* count of the number of messages dropped due to full window */
+extern THREADLOCAL int total_ACKs_received;
+extern THREADLOCAL int packets_resent;       /* count of the number of packets resent  */
+extern THREADLOCAL int new_ACKs;      /* count of the number of acks correctly received */
+extern THREADLOCAL int packets_received;  /* count of the packets received by receiver */
+extern THREADLOCAL int window_full; /* count of the number of messages dropped due to full window */
 
 #define   A    0
 #define   B    1
 
+/* the emulator can run many A/B pairs (flows); the protocol keeps state
+   per flow and uses current_flow, set before any of its routines run */
+extern int nflows;
+extern THREADLOCAL int current_flow;
+
 /* a "msg" is the data unit passed from layer 5 (teachers code) to layer  */
 /* 4 (students' code).  It contains the data (characters) to be delivered */
 /* to layer 5 via the students transport level protocol entities.         */
@@ -33,8 +57,32 @@ extern void tolayer3(int, struct pkt);
 /* deliver to A or B (int), data to deliver */
 extern void tolayer5(int, char[20]); 
 
+/* A run of in-order messages in a receive buffer: count payloads of 20
+   bytes, stride bytes apart, starting at base.  tolayer5v() hands the
+   messages of nspans such runs to the application of A or B in one call,
+   for a receiver that buffered them to fill a gap. */
+struct msgspan {
+  const char *base;
+  int count;
+  int stride;
+};
+extern void tolayer5v(int, const struct msgspan *, int);
+
+/* messages the application at A or B (int) would take now.  It takes
+   everything at once unless B's is a slow consumer (-consumer), which
+   takes one message when it is idle and none while it processes one;
+   B_appready() is called when it is done. */
+extern int tolayer5_room(int);
+
+/* whether layer 5 of A or B (int) has another message waiting to be
+   handed over after the one it is handing over now */
+extern int layer5_waiting(int);
+
 /* start timer at A or B (int), increment */
 extern void starttimer(int, double);       
 
 /* stop timer at A or B (int) */
 extern void stoptimer(int);               
+
+/* the current time, in the time units of starttimer() */
+extern double get_sim_time(void);
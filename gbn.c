@@ -1,7 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include "emulator.h"
+#include "checksum.h"
 #include "gbn.h"
 
 /* ******************************************************************
@@ -23,10 +25,67 @@
 **********************************************************************/
 
 #define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
+#ifndef AUTOWINDOW
 #define WINDOWSIZE 6    /* the maximum number of buffered unacked packet */
 #define SEQSPACE 7      /* the min sequence space for GBN must be at least windowsize + 1 */
+#else
+#define WINDOWSIZE 63   /* the most the automatic window may grow to */
+#define SEQSPACE 64
+#endif
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
 
+/* A -DPACE build spaces A's packets, new and resent alike, at least
+   PACEGAP apart instead of sending a timeout's whole window in one
+   burst.  A has one timer, so while anything is outstanding it ticks
+   every PACEGAP: each tick sends the next packet waiting in the window,
+   and the window is queued again for resending once RTT has passed in
+   ticks without an ACK moving it.  A packet may go out at once when
+   PACEGAP has passed since the last one; the ticks then start over
+   from it.  The gap defaults to a little
+   more than the 5.5 time units per packet at which the emulator's
+   in-order channel delivers on average; sending faster only stacks up
+   delay.  -DPACEGAP=t sets it. */
+#if defined(PACE) && !defined(PACEGAP)
+#define PACEGAP 6.0
+#endif
+
+/* A -DAUTOWINDOW build sizes A's window from the bandwidth-delay
+   product instead of the fixed 6.  Every new ACK gives a delivery rate
+   sample, the packets acknowledged since the one it acknowledges was
+   first sent over the time that took, and a round trip sample.  A sample
+   taken while A had less to send than the window allowed only counts if
+   it is a new high.  The window is AWGAIN times the highest rate of the
+   last AWSAMPLES samples times the least round trip seen, at least
+   AWMINWINDOW and at most WINDOWSIZE, which the sequence space of 64
+   puts at 63.  A starts with AWINITIAL packets.  The gain leaves room to
+   grow when the rate was limited by the window rather than the channel;
+   the floor of 2 is because the emulator's random 1-10 delays make the
+   least round trip far shorter than a typical one. */
+#ifdef AUTOWINDOW
+#define AWINITIAL 2
+#define AWMINWINDOW 2
+#define AWGAIN 1.5
+#define AWSAMPLES 10
+#endif
+
+/* linked beside sr.c, every global name gets a gbn_ prefix */
+#ifdef MULTIPROTOCOL
+#define ComputeChecksum gbn_ComputeChecksum
+#define IsCorrupted gbn_IsCorrupted
+#define A_init gbn_A_init
+#define B_init gbn_B_init
+#define A_input gbn_A_input
+#define B_input gbn_B_input
+#define A_output gbn_A_output
+#define A_ready gbn_A_ready
+#define A_inflight gbn_A_inflight
+#define A_window gbn_A_window
+#define A_timerinterrupt gbn_A_timerinterrupt
+#define B_output gbn_B_output
+#define B_timerinterrupt gbn_B_timerinterrupt
+#define B_appready gbn_B_appready
+#endif
+
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver  
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your 
    original checksum.  This procedure must generate a different checksum to the original if
@@ -34,19 +93,17 @@
 */
 int ComputeChecksum(struct pkt packet)
 {
-  int checksum = 0;
-  int i;
-
-  checksum = packet.seqnum;
-  checksum += packet.acknum;
-  for ( i=0; i<20; i++ ) 
-    checksum += (int)(packet.payload[i]);
-
-  return checksum;
+  /* byte sum, Internet checksum or CRC32C as selected by -checksum */
+  return pkt_checksum(&packet);
 }
 
+/* a header field outside the sequence space can only come from bit
+   errors the checksum missed, and would index past the buffers */
 bool IsCorrupted(struct pkt packet)
 {
+  if (packet.seqnum < NOTINUSE || packet.seqnum >= SEQSPACE ||
+      packet.acknum < NOTINUSE || packet.acknum >= SEQSPACE)
+    return (true);
   if (packet.checksum == ComputeChecksum(packet))
     return (false);
   else
@@ -56,24 +113,114 @@ bool IsCorrupted(struct pkt packet)
 
 /********* Sender (A) variables and functions ************/
 
-static struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
+struct sender {
+  struct pkt buffer[WINDOWSIZE];  /* array for storing packets waiting for ACK */
+  int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
+  int windowcount;                /* the number of packets currently awaiting an ACK */
+  int A_nextseqnum;               /* the next sequence number to be used by the sender */
+#ifdef PACE
+  int nextsend;                   /* window packets before this one have been sent this round */
+  int sent;                       /* window packets before this one have been sent at all */
+  int ticks;                      /* pacing ticks since the window last moved */
+  int ticking;                    /* the pacing timer is running */
+  double lastsend;                /* when A last sent a packet */
+#endif
+#ifdef AUTOWINDOW
+  int window;                     /* packets that may be awaiting an ACK */
+  double sendtime[WINDOWSIZE];    /* when each buffered packet was first sent */
+  int applimited[WINDOWSIZE];     /* it left the window short: A had no more to send */
+  int sentdelivered[WINDOWSIZE];  /* delivered, deliveredtime and ackedsent as it was */
+  double sentdeliveredtime[WINDOWSIZE];
+  double sentackedsent[WINDOWSIZE];
+  int delivered;                  /* packets acknowledged so far */
+  double deliveredtime;           /* when the last of them was */
+  double ackedsent;               /* when the last of them was first sent */
+  double rate[AWSAMPLES];         /* recent delivery rate samples, packets per time unit */
+  int nextrate;
+  double minrtt;                  /* least round trip sample, -1 none yet */
+#endif
+};
+
+static struct sender *senders = NULL;  /* sender state of every flow */
+
+/* the window A lets out now */
+#ifdef AUTOWINDOW
+#define WINDOW(s) ((s)->window)
+#else
+#define WINDOW(s) WINDOWSIZE
+#endif
+
+#ifdef AUTOWINDOW
+/* the packet in buffer slot i goes out for the first time now; the
+   samples its ACK gives are timed from here even if it is resent, which
+   can only make them slower, never faster */
+static void autowindow_sent(struct sender *s, int i)
+{
+  double now = get_sim_time();
+
+  if (s->windowcount == 1)
+    s->deliveredtime = s->ackedsent = now;  /* nothing was in flight: the intervals start here */
+  s->sendtime[i] = now;
+  s->applimited[i] = s->windowcount < s->window && !layer5_waiting(A);
+  s->sentdelivered[i] = s->delivered;
+  s->sentdeliveredtime[i] = s->deliveredtime;
+  s->sentackedsent[i] = s->ackedsent;
+}
+
+/* ackcount packets acknowledged, the last of them in buffer slot i */
+static void autowindow_acked(struct sender *s, int i, int ackcount)
+{
+  double now = get_sim_time(), rtt, interval, rate, maxrate = 0.0, bdp;
+  int k;
+
+  /* over the longer of the time the packets took to be sent and to be
+     acknowledged, so that ACKs bunched up do not pass for a fast path */
+  s->delivered += ackcount;
+  s->deliveredtime = now;
+  s->ackedsent = s->sendtime[i];
+  interval = now - s->sentdeliveredtime[i];
+  if (s->sendtime[i] - s->sentackedsent[i] > interval)
+    interval = s->sendtime[i] - s->sentackedsent[i];
+  for (k=0; k<AWSAMPLES; k++)
+    if (s->rate[k] > maxrate)
+      maxrate = s->rate[k];
+  if (interval > 0.0) {
+    rate = (s->delivered - s->sentdelivered[i]) / interval;
+    if (!s->applimited[i] || rate > maxrate) {
+      s->rate[s->nextrate] = rate;
+      s->nextrate = (s->nextrate + 1) % AWSAMPLES;
+    }
+  }
+
+  rtt = now - s->sendtime[i];
+  if (s->minrtt < 0.0 || rtt < s->minrtt)
+    s->minrtt = rtt;
+
+  maxrate = 0.0;
+  for (k=0; k<AWSAMPLES; k++)
+    if (s->rate[k] > maxrate)
+      maxrate = s->rate[k];
+  bdp = AWGAIN * maxrate * s->minrtt;
+  s->window = bdp < AWMINWINDOW ? AWMINWINDOW : bdp >= WINDOWSIZE ? WINDOWSIZE : (int)(bdp + 0.999);
+  if (TRACE > 1)
+    printf("----A: rate %.4f, least RTT %.3f, window %d\n", maxrate, s->minrtt, s->window);
+}
+#endif
 
 /* called from layer 5 (application layer), passed the message to be sent to other side */
 void A_output(struct msg message)
 {
+  struct sender *s = &senders[current_flow];
   struct pkt sendpkt;
   int i;
 
   /* if not blocked waiting on ACK */
-  if ( windowcount < WINDOWSIZE) {
+  if ( s->windowcount < WINDOW(s)) {
     if (TRACE > 1)
       printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
 
     /* create packet */
-    sendpkt.seqnum = A_nextseqnum;
+    sendpkt.seqnum = s->A_nextseqnum;
     sendpkt.acknum = NOTINUSE;
     for ( i=0; i<20 ; i++ ) 
       sendpkt.payload[i] = message.data[i];
@@ -81,21 +228,50 @@ void A_output(struct msg message)
 
     /* put packet in window buffer */
     /* windowlast will always be 0 for alternating bit; but not for GoBackN */
-    windowlast = (windowlast + 1) % WINDOWSIZE; 
-    buffer[windowlast] = sendpkt;
-    windowcount++;
+    s->windowlast = (s->windowlast + 1) % WINDOWSIZE; 
+    s->buffer[s->windowlast] = sendpkt;
+    s->windowcount++;
+
+#ifdef PACE
+    /* send it now if the pacer allows, else it waits for a tick */
+    if (s->nextsend == s->windowcount - 1
+        && get_sim_time() - s->lastsend >= PACEGAP) {
+      if (TRACE > 0)
+        printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
+#ifdef AUTOWINDOW
+      autowindow_sent(s, s->windowlast);
+#endif
+      tolayer3 (A, sendpkt);
+      s->nextsend = s->sent = s->windowcount;
+      s->lastsend = get_sim_time();
+      if (s->ticking)
+        stoptimer(A);           /* the next tick is a gap after this send */
+      starttimer(A, PACEGAP);
+      s->ticking = 1;
+    }
+    else if (!s->ticking) {
+      /* idle since the last send: tick when its gap is over */
+      starttimer(A, s->lastsend + PACEGAP - get_sim_time());
+      s->ticking = 1;
+    }
+    s->A_nextseqnum = (s->A_nextseqnum + 1) % SEQSPACE;
+    return;
+#endif
 
     /* send out packet */
     if (TRACE > 0)
       printf("Sending packet %d to layer 3\n", sendpkt.seqnum);
+#ifdef AUTOWINDOW
+    autowindow_sent(s, s->windowlast);
+#endif
     tolayer3 (A, sendpkt);
 
     /* start timer if first packet in window */
-    if (windowcount == 1)
+    if (s->windowcount == 1)
       starttimer(A,RTT);
 
     /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE;  
+    s->A_nextseqnum = (s->A_nextseqnum + 1) % SEQSPACE;  
   }
   /* if blocked,  window is full */
   else {
@@ -106,11 +282,33 @@ void A_output(struct msg message)
 }
 
 
+/* whether A_output would take a message now, for backlogged sources */
+int A_ready(void)
+{
+  return senders[current_flow].windowcount < WINDOW(&senders[current_flow]);
+}
+
+
+/* packets A has sent and not yet seen acknowledged, for statistics */
+int A_inflight(void)
+{
+  return senders[current_flow].windowcount;
+}
+
+
+/* packets A lets be awaiting an ACK now, for the report */
+int A_window(void)
+{
+  return WINDOW(&senders[current_flow]);
+}
+
+
 /* called from layer 3, when a packet arrives for layer 4 
    In this practical this will always be an ACK as B never sends data.
 */
 void A_input(struct pkt packet)
 {
+  struct sender *s = &senders[current_flow];
   int ackcount = 0;
   int i;
 
@@ -121,9 +319,9 @@ void A_input(struct pkt packet)
     total_ACKs_received++;
 
     /* check if new ACK or duplicate */
-    if (windowcount != 0) {
-          int seqfirst = buffer[windowfirst].seqnum;
-          int seqlast = buffer[windowlast].seqnum;
+    if (s->windowcount != 0) {
+          int seqfirst = s->buffer[s->windowfirst].seqnum;
+          int seqlast = s->buffer[s->windowlast].seqnum;
           /* check case when seqnum has and hasn't wrapped */
           if (((seqfirst <= seqlast) && (packet.acknum >= seqfirst && packet.acknum <= seqlast)) ||
               ((seqfirst > seqlast) && (packet.acknum >= seqfirst || packet.acknum <= seqlast))) {
@@ -139,16 +337,28 @@ void A_input(struct pkt packet)
             else
               ackcount = SEQSPACE - seqfirst + packet.acknum;
 
+#ifdef AUTOWINDOW
+            autowindow_acked(s, (s->windowfirst + ackcount - 1) % WINDOWSIZE, ackcount);
+#endif
+
 	    /* slide window by the number of packets ACKed */
-            windowfirst = (windowfirst + ackcount) % WINDOWSIZE;
+            s->windowfirst = (s->windowfirst + ackcount) % WINDOWSIZE;
 
             /* delete the acked packets from window buffer */
             for (i=0; i<ackcount; i++)
-              windowcount--;
+              s->windowcount--;
+
+#ifdef PACE
+            /* the pacing timer keeps ticking, the timeout starts over */
+            s->nextsend = s->nextsend > ackcount ? s->nextsend - ackcount : 0;
+            s->sent = s->sent > ackcount ? s->sent - ackcount : 0;
+            s->ticks = 0;
+            return;
+#endif
 
 	    /* start timer again if there are still more unacked packets in window */
             stoptimer(A);
-            if (windowcount > 0)
+            if (s->windowcount > 0)
               starttimer(A, RTT);
 
           }
@@ -165,17 +375,52 @@ void A_input(struct pkt packet)
 /* called when A's timer goes off */
 void A_timerinterrupt(void)
 {
+  struct sender *s = &senders[current_flow];
   int i;
 
+#ifdef PACE
+  s->ticking = 0;
+  if (s->windowcount == 0)
+    return;                     /* idle: the next packet may go at once */
+  if (++s->ticks * PACEGAP >= RTT) {
+    if (TRACE > 0)
+      printf("----A: time out,resend packets!\n");
+    s->nextsend = 0;            /* go back: the window is sent again, paced */
+    s->ticks = 0;
+  }
+  if (s->nextsend < s->windowcount) {
+    i = (s->windowfirst + s->nextsend) % WINDOWSIZE;
+    if (s->nextsend < s->sent) {
+      if (TRACE > 0)
+        printf ("---A: resending packet %d\n", s->buffer[i].seqnum);
+      packets_resent++;
+    }
+    else if (TRACE > 0)
+      printf("Sending packet %d to layer 3\n", s->buffer[i].seqnum);
+#ifdef AUTOWINDOW
+    if (s->nextsend >= s->sent)
+      autowindow_sent(s, i);
+#endif
+    tolayer3(A, s->buffer[i]);
+    s->lastsend = get_sim_time();
+    s->nextsend++;
+    if (s->nextsend > s->sent)
+      s->sent = s->nextsend;
+  }
+  starttimer(A, PACEGAP);
+  s->ticking = 1;
+  return;
+#endif
+
   if (TRACE > 0)
     printf("----A: time out,resend packets!\n");
 
-  for(i=0; i<windowcount; i++) {
+  for(i=0; i<s->windowcount; i++) {
 
     if (TRACE > 0)
-      printf ("---A: resending packet %d\n", (buffer[(windowfirst+i) % WINDOWSIZE]).seqnum);
+      printf ("---A: resending packet %d\n", (s->buffer[(s->windowfirst+i) % WINDOWSIZE]).seqnum);
 
-    tolayer3(A,buffer[(windowfirst+i) % WINDOWSIZE]);
+    tolayer3(A,s->buffer[(s->windowfirst+i) % WINDOWSIZE]);
     packets_resent++;
     if (i==0) starttimer(A,RTT);
   }
@@ -187,32 +432,58 @@ void A_timerinterrupt(void)
 /* entity A routines are called. You can use it to do any initialization */
 void A_init(void)
 {
+  struct sender *s;
+
+  /* the first flow to start allocates the state of all of them */
+  if (senders == NULL) {
+    senders = calloc(nflows, sizeof(struct sender));
+    if (senders == NULL) {
+      printf("memory allocation for sender state failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  s = &senders[current_flow];
+
   /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.  
+  s->A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
+  s->windowfirst = 0;
+  s->windowlast = -1;   /* windowlast is where the last packet sent is stored.  
 		     new packets are placed in winlast + 1 
 		     so initially this is set to -1
 		   */
-  windowcount = 0;
+  s->windowcount = 0;
+#ifdef PACE
+  s->nextsend = s->sent = s->ticks = s->ticking = 0;
+  s->lastsend = -PACEGAP;
+#endif
+#ifdef AUTOWINDOW
+  s->window = AWINITIAL;
+  s->minrtt = -1.0;
+#endif
 }
 
 
 
 /********* Receiver (B)  variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+struct receiver {
+  int expectedseqnum; /* the sequence number expected next by the receiver */
+  int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+};
+
+static struct receiver *receivers = NULL;  /* receiver state of every flow */
+static struct pkt ACKtemplate;  /* payload of 0's with its checksum, copied for every ACK */
 
 
 /* called from layer 3, when a packet arrives for layer 4 at B*/
 void B_input(struct pkt packet)
 {
+  struct receiver *r = &receivers[current_flow];
   struct pkt sendpkt;
-  int i;
 
-  /* if not corrupted and received packet is in order */
-  if  ( (!IsCorrupted(packet))  && (packet.seqnum == expectedseqnum) ) {
+  /* if not corrupted, received packet is in order and the application
+     can take it (Go-Back-N has no buffer to hold it for a slow one) */
+  if  ( (!IsCorrupted(packet))  && (packet.seqnum == r->expectedseqnum) && tolayer5_room(B) > 0 ) {
     if (TRACE > 0)
       printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
     packets_received++;
@@ -221,31 +492,27 @@ void B_input(struct pkt packet)
     tolayer5(B, packet.payload);
 
     /* send an ACK for the received packet */
-    sendpkt.acknum = expectedseqnum;
+    sendpkt.acknum = r->expectedseqnum;
 
     /* update state variables */
-    expectedseqnum = (expectedseqnum + 1) % SEQSPACE;        
+    r->expectedseqnum = (r->expectedseqnum + 1) % SEQSPACE;        
   }
   else {
     /* packet is corrupted or out of order resend last ACK */
     if (TRACE > 0) 
       printf("----B: packet corrupted or not expected sequence number, resend ACK!\n");
-    if (expectedseqnum == 0)
+    if (r->expectedseqnum == 0)
       sendpkt.acknum = SEQSPACE - 1;
     else
-      sendpkt.acknum = expectedseqnum - 1;
+      sendpkt.acknum = r->expectedseqnum - 1;
   }
 
-  /* create packet */
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
-    
-  /* we don't have any data to send.  fill payload with 0's */
-  for ( i=0; i<20 ; i++ ) 
-    sendpkt.payload[i] = '0';  
-
-  /* computer checksum */
-  sendpkt.checksum = ComputeChecksum(sendpkt); 
+  /* create packet from the template, only the header changes so the
+     checksum is adjusted instead of recomputed over the payload */
+  sendpkt.seqnum = r->B_nextseqnum;
+  r->B_nextseqnum = (r->B_nextseqnum + 1) % 2;
+  memcpy(sendpkt.payload, ACKtemplate.payload, sizeof(sendpkt.payload));
+  sendpkt.checksum = pkt_checksum_adjust(&ACKtemplate, sendpkt.seqnum, sendpkt.acknum);
 
   /* send out packet */
   tolayer3 (B, sendpkt);
@@ -255,8 +522,27 @@ void B_input(struct pkt packet)
 /* entity B routines are called. You can use it to do any initialization */
 void B_init(void)
 {
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
+  struct receiver *r;
+  int i;
+
+  if (receivers == NULL) {
+    receivers = calloc(nflows, sizeof(struct receiver));
+    if (receivers == NULL) {
+      printf("memory allocation for receiver state failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  r = &receivers[current_flow];
+
+  r->expectedseqnum = 0;
+  r->B_nextseqnum = 1;
+
+  /* we don't have any data to send.  fill payload with 0's */
+  ACKtemplate.seqnum = 0;
+  ACKtemplate.acknum = 0;
+  for (i=0; i<20; i++)
+    ACKtemplate.payload[i] = '0';
+  ACKtemplate.checksum = ComputeChecksum(ACKtemplate);
 }
 
 /******************************************************************************
@@ -273,3 +559,9 @@ void B_timerinterrupt(void)
 {
 }
 
+/* called when B's application can take a message again; nothing is
+   held for it, A's resends bring the next one */
+void B_appready(void)
+{
+}
+
@@ -3,9 +3,29 @@ extern void B_init(void);
 extern void A_input(struct pkt);
 extern void B_input(struct pkt);
 extern void A_output(struct msg);
+extern int A_ready(void);     /* A_output would take a message now */
+extern int A_inflight(void);  /* packets sent and not yet acknowledged */
+extern int A_window(void);    /* packets A lets be awaiting an ACK now */
 extern void A_timerinterrupt(void);
 
 /* included for extension to bidirectional communication */
 #define BIDIRECTIONAL 0       /*  0 = A->B  1 =  A<->B */
 extern void B_output(struct msg);
-extern void B_timerinterrupt(void);
\ No newline at end of file
+extern void B_timerinterrupt(void);
+extern void B_appready(void); /* B's application can take a message again */
+
+/* entry points when linked together with the other protocol (-DMULTIPROTOCOL) */
+#ifdef MULTIPROTOCOL
+extern void gbn_A_init(void);
+extern void gbn_B_init(void);
+extern void gbn_A_input(struct pkt);
+extern void gbn_B_input(struct pkt);
+extern void gbn_A_output(struct msg);
+extern int gbn_A_ready(void);
+extern int gbn_A_inflight(void);
+extern int gbn_A_window(void);
+extern void gbn_A_timerinterrupt(void);
+extern void gbn_B_output(struct msg);
+extern void gbn_B_timerinterrupt(void);
+extern void gbn_B_appready(void);
+#endif
\ No newline at end of file
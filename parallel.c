@@ -0,0 +1,274 @@
+#define _POSIX_C_SOURCE 200112L   /* pthread barriers, fork */
+#ifdef PARALLEL
+#include <pthread.h>
+#endif
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "parallel.h"
+
+/* ******************************************************************
+   Worker threads for the partitioned engine.  The workers wait on a
+   barrier for the start of a round, run their share and meet again on
+   a second barrier, so a round costs two barrier crossings and no
+   thread creation.
+**********************************************************************/
+
+static int nthreads = 1;
+static void (*roundwork)(int thread);
+
+#ifdef PARALLEL
+static pthread_t *threads;
+static int *threadids;
+static pthread_barrier_t roundstart, rounddone;
+static int stopping = 0;
+
+static void *worker(void *arg)
+{
+  int thread = *(int *)arg;
+
+  for (;;) {
+    pthread_barrier_wait(&roundstart);
+    if (stopping)
+      return NULL;
+    roundwork(thread);
+    pthread_barrier_wait(&rounddone);
+  }
+}
+#endif
+
+void parallel_start(int n, void (*work)(int thread))
+{
+  nthreads = n;
+  roundwork = work;
+#ifdef PARALLEL
+  if (nthreads > 1) {
+    int t;
+
+    threads = malloc(nthreads * sizeof(pthread_t));
+    threadids = malloc(nthreads * sizeof(int));
+    if (threads == 0 || threadids == 0) {
+      printf("memory allocation for threads failed.");
+      exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&roundstart, NULL, nthreads);
+    pthread_barrier_init(&rounddone, NULL, nthreads);
+    stopping = 0;
+    for (t=1; t<nthreads; t++) {
+      threadids[t] = t;
+      if (pthread_create(&threads[t], NULL, worker, &threadids[t]) != 0) {
+        printf("cannot start worker threads.");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+#else
+  if (nthreads != 1) {
+    printf("threads need a -DPARALLEL build.");
+    exit(EXIT_FAILURE);
+  }
+#endif
+}
+
+void parallel_round(void)
+{
+#ifdef PARALLEL
+  if (nthreads > 1) {
+    pthread_barrier_wait(&roundstart);
+    roundwork(0);
+    pthread_barrier_wait(&rounddone);
+    return;
+  }
+#endif
+  roundwork(0);
+}
+
+void parallel_stop(void)
+{
+#ifdef PARALLEL
+  if (nthreads > 1) {
+    int t;
+
+    stopping = 1;
+    pthread_barrier_wait(&roundstart);
+    for (t=1; t<nthreads; t++)
+      pthread_join(threads[t], NULL);
+    pthread_barrier_destroy(&roundstart);
+    pthread_barrier_destroy(&rounddone);
+    free(threads);
+    free(threadids);
+  }
+#endif
+  nthreads = 1;
+}
+
+
+/* ******************************************************************
+   Forked copies of the whole process share its memory copy-on-write, so
+   a child starts from exactly the state the parent reached.  Each child
+   writes to a temporary file of its own, which the parent copies out in
+   order once they are done, so their reports do not interleave.
+**********************************************************************/
+
+#define MAXFORKS 64
+
+static int nforks = 0;
+static pid_t forkpid[MAXFORKS];
+static FILE *forkout[MAXFORKS];
+
+int parallel_fork(int n)
+{
+  int k;
+
+  if (n > MAXFORKS)
+    n = MAXFORKS;
+  fflush(NULL);     /* or the children would write the parent's buffered output again */
+  for (k=0; k<n; k++) {
+    forkout[k] = tmpfile();
+    if (forkout[k] == NULL) {
+      printf("cannot create the output file of a forked copy.");
+      exit(EXIT_FAILURE);
+    }
+    forkpid[k] = fork();
+    if (forkpid[k] < 0) {
+      printf("cannot fork a copy of the simulation.");
+      exit(EXIT_FAILURE);
+    }
+    if (forkpid[k] == 0) {
+      dup2(fileno(forkout[k]), fileno(stdout));
+      nforks = 0;
+      return k + 1;
+    }
+  }
+  nforks = n;
+  return 0;
+}
+
+void parallel_join(void)
+{
+  char buf[4096];
+  size_t len;
+  int k;
+
+  fflush(stdout);
+  for (k=0; k<nforks; k++) {
+    waitpid(forkpid[k], NULL, 0);
+    rewind(forkout[k]);
+    while ((len = fread(buf, 1, sizeof(buf), forkout[k])) > 0)
+      fwrite(buf, 1, len, stdout);
+    fclose(forkout[k]);
+  }
+  nforks = 0;
+}
+
+/* ******************************************************************
+   Replications run as copies of the process as well, each writing its
+   results down a pipe of its own before it exits.  A copy's results are
+   a few doubles, well under the size a pipe takes without blocking, so
+   it never waits for the parent to read them.
+**********************************************************************/
+
+static struct {
+  pid_t pid;
+  int fd;          /* read end of its pipe */
+  int id;
+} spawned[MAXFORKS];
+static int nspawned = 0;
+static int resultfd = -1;   /* in a copy: write end of its pipe */
+
+int parallel_cpus(void)
+{
+  long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (n < 1)
+    n = 1;
+  return n > MAXFORKS ? MAXFORKS : (int)n;
+}
+
+int parallel_spawn(int id)
+{
+  int fds[2];
+  pid_t pid;
+
+  if (nspawned == MAXFORKS) {
+    printf("too many copies running at once.");
+    exit(EXIT_FAILURE);
+  }
+  fflush(NULL);
+  if (pipe(fds) != 0) {
+    printf("cannot create the pipe of a replication.");
+    exit(EXIT_FAILURE);
+  }
+  pid = fork();
+  if (pid < 0) {
+    printf("cannot fork a replication.");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    while (nspawned > 0)
+      close(spawned[--nspawned].fd);
+    resultfd = fds[1];
+    if (freopen("/dev/null", "w", stdout) == NULL)
+      exit(EXIT_FAILURE);
+    return 1;
+  }
+  close(fds[1]);
+  spawned[nspawned].pid = pid;
+  spawned[nspawned].fd = fds[0];
+  spawned[nspawned].id = id;
+  nspawned++;
+  return 0;
+}
+
+void parallel_result(const double *v, int n)
+{
+  fflush(NULL);
+  if (write(resultfd, v, n * sizeof(double)) != (ssize_t)(n * sizeof(double)))
+    _exit(EXIT_FAILURE);
+  _exit(EXIT_SUCCESS);
+}
+
+int parallel_reap(double *v, int n)
+{
+  pid_t pid;
+  ssize_t len;
+  int k, id;
+
+  if (nspawned == 0)
+    return -1;
+  pid = wait(NULL);
+  for (k=0; k<nspawned && spawned[k].pid != pid; k++)
+    ;
+  if (k == nspawned) {
+    printf("lost track of a replication.");
+    exit(EXIT_FAILURE);
+  }
+  len = read(spawned[k].fd, v, n * sizeof(double));
+  close(spawned[k].fd);
+  id = spawned[k].id;
+  spawned[k] = spawned[--nspawned];
+  if (len != (ssize_t)(n * sizeof(double))) {
+    printf("replication %d ended without results.\n", id);
+    exit(EXIT_FAILURE);
+  }
+  return id;
+}
+
+void parallel_cancel(void)
+{
+  int k;
+
+  for (k=0; k<nspawned; k++) {
+    kill(spawned[k].pid, SIGKILL);
+    waitpid(spawned[k].pid, NULL, 0);
+    close(spawned[k].fd);
+  }
+  nspawned = 0;
+}
@@ -0,0 +1,26 @@
+/* A pool of threads that run rounds of work together: every round calls
+   work(thread) once for each thread 0..n-1 and returns when all of them
+   are done.  Thread 0 is the caller.  Without -DPARALLEL there are no
+   threads and n must be 1. */
+extern void parallel_start(int n, void (*work)(int thread));
+extern void parallel_round(void);
+extern void parallel_stop(void);
+
+/* Fork n copies of the process (at most 64).  Returns 0 in the parent
+   and 1..n in the copies, whose standard output goes to a file of their
+   own.  parallel_join() waits for the copies and then prints their
+   output in order. */
+extern int parallel_fork(int n);
+extern void parallel_join(void);
+
+/* Replications: parallel_spawn(id) forks a copy that returns 1 with its
+   standard output discarded, the parent gets 0.  The copy ends by handing
+   its n results to parallel_result().  parallel_reap() waits for any copy
+   and returns its id with its results, or -1 if none is running;
+   parallel_cancel() kills the ones still running.  parallel_cpus() is
+   the number of processors, at most 64. */
+extern int parallel_cpus(void);
+extern int parallel_spawn(int id);
+extern void parallel_result(const double *v, int n);
+extern int parallel_reap(double *v, int n);
+extern void parallel_cancel(void);
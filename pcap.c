@@ -0,0 +1,202 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "emulator.h"
+#include "checksum.h"
+#include "pcap.h"
+
+/* ******************************************************************
+   pcapng writer for the packets crossing layer 3.
+
+   The file is one section with one raw IP interface; every packet is an
+   Enhanced Packet Block whose flags say whether it was leaving or
+   arriving, with a comment when the channel dropped, corrupted or
+   duplicated it.  Blocks are assembled in a large buffer of our own and
+   the stream is unbuffered, so a million-packet capture costs a few
+   hundred writes, and a forked copy of the run has nothing pending that
+   it could write twice.  Numbers are in host byte order, which the
+   byte-order magic of the section tells the readers.
+**********************************************************************/
+
+#define PCAP_BUFSIZE   (1 << 20)
+#define PCAP_NOTEMAX   128          /* longest comment kept */
+#define PCAP_PKTLEN    (20 + 8 + 32) /* IPv4 + UDP + seq, ack, checksum, payload */
+
+#define LINKTYPE_RAW   101          /* packets start with the IP header */
+
+static FILE *pcapfile = NULL;
+static unsigned char *buf;
+static size_t buflen;
+
+static void flush(void)
+{
+  if (buflen > 0 && fwrite(buf, 1, buflen, pcapfile) != buflen) {
+    printf("writing the packet capture failed.\n");
+    exit(EXIT_FAILURE);
+  }
+  buflen = 0;
+}
+
+/* room for n more bytes */
+static unsigned char *reserve(size_t n)
+{
+  if (buflen + n > PCAP_BUFSIZE)
+    flush();
+  return buf + buflen;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+  memcpy(p, &v, 4);
+}
+
+static void put16(unsigned char *p, unsigned short v)
+{
+  memcpy(p, &v, 2);
+}
+
+static void putbe32(unsigned char *p, unsigned int v)
+{
+  p[0] = (unsigned char)(v >> 24);
+  p[1] = (unsigned char)(v >> 16);
+  p[2] = (unsigned char)(v >> 8);
+  p[3] = (unsigned char)v;
+}
+
+static void putbe16(unsigned char *p, unsigned int v)
+{
+  p[0] = (unsigned char)(v >> 8);
+  p[1] = (unsigned char)v;
+}
+
+int pcap_open(const char *name)
+{
+  unsigned char *p;
+
+  pcapfile = fopen(name, "wb");
+  buf = malloc(PCAP_BUFSIZE);
+  if (pcapfile == NULL || buf == NULL)
+    return 0;
+  setvbuf(pcapfile, NULL, _IONBF, 0);
+  buflen = 0;
+
+  /* Section Header Block, section length unknown */
+  p = reserve(28);
+  put32(p, 0x0A0D0D0AU);
+  put32(p + 4, 28);
+  put32(p + 8, 0x1A2B3C4DU);
+  put16(p + 12, 1);
+  put16(p + 14, 0);
+  memset(p + 16, 0xff, 8);
+  put32(p + 24, 28);
+  buflen += 28;
+
+  /* Interface Description Block, microsecond timestamps (the default) */
+  p = reserve(20);
+  put32(p, 1);
+  put32(p + 4, 20);
+  put16(p + 8, LINKTYPE_RAW);
+  put16(p + 10, 0);
+  put32(p + 12, PCAP_PKTLEN);
+  put32(p + 16, 20);
+  buflen += 20;
+  return 1;
+}
+
+int pcap_enabled(void)
+{
+  return pcapfile != NULL;
+}
+
+/* IPv4 header, UDP header and the packet fields at p */
+static void encode(unsigned char *p, int flow, int path, int from, const struct pkt *packet)
+{
+  unsigned short sum;
+
+  memset(p, 0, 28);
+  p[0] = 0x45;                        /* version 4, 5 words of header */
+  putbe16(p + 2, PCAP_PKTLEN);
+  p[8] = 64;                          /* TTL */
+  p[9] = 17;                          /* UDP */
+  p[12] = p[16] = 10;
+  p[13] = p[17] = (unsigned char)(path >> 8);
+  p[14] = p[18] = (unsigned char)path;
+  p[15] = (unsigned char)(from + 1);
+  p[19] = (unsigned char)(2 - from);
+  sum = (unsigned short)~inet_fold(inet_update(0, p, 20));
+  memcpy(p + 10, &sum, 2);            /* the sum is in the byte order of the header */
+
+  putbe16(p + 20, 1024 + flow % 64512);
+  putbe16(p + 22, 1024 + flow % 64512);
+  putbe16(p + 24, PCAP_PKTLEN - 20);  /* UDP checksum 0: not computed */
+
+  putbe32(p + 28, (unsigned int)packet->seqnum);
+  putbe32(p + 32, (unsigned int)packet->acknum);
+  putbe32(p + 36, (unsigned int)packet->checksum);
+  memcpy(p + 40, packet->payload, 20);
+}
+
+void pcap_packet(double time, int flow, int path, int from, int inbound,
+                 const struct pkt *packet, const char *note)
+{
+  unsigned char *p;
+  size_t notelen = 0, optlen, len;
+  double usec, high;
+
+  if (note != NULL) {
+    notelen = strlen(note);
+    if (notelen > PCAP_NOTEMAX)
+      notelen = PCAP_NOTEMAX;
+  }
+  optlen = 8 + 4;                     /* epb_flags, opt_endofopt */
+  if (notelen > 0)
+    optlen += 4 + ((notelen + 3) & ~(size_t)3);
+  len = 28 + PCAP_PKTLEN + optlen + 4;
+
+  p = reserve(len);
+  memset(p, 0, len);
+  usec = floor(time * 1000.0 + 0.5);  /* a time unit is a millisecond */
+  high = floor(usec / 4294967296.0);
+  put32(p, 6);
+  put32(p + 4, (unsigned int)len);
+  put32(p + 8, 0);                    /* interface */
+  put32(p + 12, (unsigned int)high);
+  put32(p + 16, (unsigned int)(usec - high * 4294967296.0));
+  put32(p + 20, PCAP_PKTLEN);
+  put32(p + 24, PCAP_PKTLEN);
+  encode(p + 28, flow, path, from, packet);
+
+  p += 28 + PCAP_PKTLEN;
+  put16(p, 2);                        /* epb_flags: inbound 1, outbound 2 */
+  put16(p + 2, 4);
+  put32(p + 4, inbound ? 1 : 2);
+  p += 8;
+  if (notelen > 0) {
+    put16(p, 1);                      /* opt_comment */
+    put16(p + 2, (unsigned short)notelen);
+    memcpy(p + 4, note, notelen);
+    p += 4 + ((notelen + 3) & ~(size_t)3);
+  }
+  p += 4;                             /* opt_endofopt, zeroed */
+  put32(p, (unsigned int)len);
+  buflen += len;
+}
+
+void pcap_close(void)
+{
+  if (pcapfile == NULL)
+    return;
+  flush();
+  fclose(pcapfile);
+  pcapfile = NULL;
+}
+
+void pcap_discard(void)
+{
+  if (pcapfile == NULL)
+    return;
+  buflen = 0;
+  fclose(pcapfile);
+  pcapfile = NULL;
+}
@@ -0,0 +1,21 @@
+/* Packet capture (-pcap file).  Every packet handed to layer 3 and every
+   arrival at the other side is written to a pcapng file as an IPv4/UDP
+   datagram stamped with the simulated time, one time unit written as a
+   millisecond.  Entity A of path p is 10.p.p.1 and B is 10.p.p.2 (the
+   path split over two octets), flow f uses port 1024 + f at both ends,
+   and the UDP payload is seqnum, acknum and checksum as 32 bit big
+   endian numbers followed by the 20 payload bytes.  Returns 0 if the
+   file cannot be created. */
+extern int pcap_open(const char *name);
+extern int pcap_enabled(void);
+
+/* record packet of flow on path, sent by entity from: as it leaves
+   (inbound 0) or as it reaches the other entity (inbound 1).  note, if
+   not NULL, is attached as a comment, e.g. why the packet was dropped. */
+extern void pcap_packet(double time, int flow, int path, int from, int inbound,
+                        const struct pkt *packet, const char *note);
+
+/* write out what is buffered and close the file; a forked copy of the
+   run calls pcap_discard() instead, leaving the file to the original */
+extern void pcap_close(void);
+extern void pcap_discard(void);
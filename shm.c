@@ -0,0 +1,461 @@
+/* ******************************************************************
+   Shared-memory backend.  Runs A and B of gbn.c or sr.c, unchanged, as
+   two processes pinned to different CPUs that exchange packets through
+   a pair of lock-free single-producer/single-consumer rings in a shared
+   memory segment, one ring per direction.  Nothing on the packet path
+   makes a system call, so the run measures what the protocol itself
+   costs per packet across cores.  It is linked instead of emulator.c
+   (Linux only):
+
+     gcc -ansi -Wall -pedantic -o gbn_shm shm.c checksum.c gbn.c
+
+   Every ring slot and index has a 64 byte cache line of its own.  The
+   producer fills slots and publishes its tail once per loop turn with a
+   release store; the consumer reads the tail once with an acquire load,
+   takes everything up to it and then publishes its head, so the index
+   lines change hands once per batch rather than once per packet.  Each
+   side keeps the other's index cached and only reloads it when the ring
+   looks full or empty.  Loss and corruption are applied by the sender
+   with the emulator's probabilities; a packet for a full ring is lost
+   like one for a full queue.  A is a saturated source.
+**********************************************************************/
+#define _GNU_SOURCE               /* sched_setaffinity, MAP_ANONYMOUS */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "emulator.h"
+#include "gbn.h"
+#include "checksum.h"
+
+int TRACE = 0;
+int nflows = 1;
+THREADLOCAL int current_flow = 0;
+
+/* statistics updated by the protocol */
+THREADLOCAL int window_full;
+THREADLOCAL int total_ACKs_received;
+THREADLOCAL int packets_resent;
+THREADLOCAL int new_ACKs;
+THREADLOCAL int packets_received;
+
+#define CACHELINE 64
+#define RINGSIZE 4096             /* slots per ring, a power of two */
+#define MAXTAKEN 4096             /* messages in A's window, for their latency */
+
+struct slot {
+  struct pkt packet;
+  char pad[CACHELINE - sizeof(struct pkt)];
+};
+
+struct index {
+  unsigned long value;
+  char pad[CACHELINE - sizeof(unsigned long)];
+};
+
+/* one direction: written by the sender of that direction only, except head */
+struct ring {
+  struct index tail;              /* next slot the producer fills */
+  struct index head;              /* next slot the consumer takes */
+  struct slot slots[RINGSIZE];
+};
+
+/* what each side reports when it is done */
+struct report {
+  long packets_sent, packets_lost, packets_corrupt, ring_full, packets_arrived;
+  long batches, timeouts;
+  int packets_resent, packets_received, window_full;
+  int window;                     /* A's window at the end */
+  double cpu;
+  char pad[CACHELINE];
+};
+
+/* the shared segment */
+struct shared {
+  struct ring ring[2];            /* indexed by the sending entity */
+  struct index done;              /* B has delivered them all, or gave up */
+  double taken[MAXTAKEN];         /* when A took message k, in slot k % MAXTAKEN */
+  struct report report[2];
+  double latencysum, latencymax;
+  int delivered;
+};
+
+static struct shared *shm;
+static int self;                  /* the entity this process runs */
+static int nmsgs = 1000000;
+static double lossprob = 0.0;
+static double corruptprob = 0.0;
+static double timeunit = 10.0;    /* microseconds per protocol time unit */
+static int cpu[2] = { 0, 1 };     /* CPUs of A and B */
+
+/* the sender's and the receiver's view of their rings */
+static unsigned long txtail, txhead;    /* own tail, cached head of the consumer */
+static unsigned long rxhead, rxtail;    /* own head, cached tail of the producer */
+static unsigned long published;         /* tail the consumer has been shown */
+
+static int armed = 0;             /* this entity's protocol timer */
+static double deadline;
+static int generated = 0;
+static struct report *rep;
+
+/* random number in [0,1], as the emulator draws them */
+double jimsrand(void)
+{
+  return rand() / (double)RAND_MAX;
+}
+
+/* monotonic wall clock in microseconds, from the vDSO */
+double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* the clock in protocol time units, for the protocol */
+double get_sim_time(void)
+{
+  return now() / timeunit;
+}
+
+double cputime(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/* the emulator's interface to the protocol */
+void tolayer3(int AorB, struct pkt packet)
+{
+  struct ring *r = &shm->ring[AorB];
+  double x;
+
+  rep->packets_sent++;
+  if (jimsrand() < lossprob) {
+    rep->packets_lost++;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being lost\n");
+    return;
+  }
+  if (jimsrand() < corruptprob) {
+    rep->packets_corrupt++;
+    if ((x = jimsrand()) < .75)
+      packet.payload[0] = 'Z';
+    else if (x < .875)
+      packet.seqnum = 999999;
+    else
+      packet.acknum = 999999;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being corrupted\n");
+  }
+  if (txtail - txhead == RINGSIZE) {
+    txhead = __atomic_load_n(&r->head.value, __ATOMIC_ACQUIRE);
+    if (txtail - txhead == RINGSIZE) {
+      rep->ring_full++;
+      return;
+    }
+  }
+  r->slots[txtail % RINGSIZE].packet = packet;
+  txtail++;
+}
+
+/* make the packets written so far visible to the consumer */
+void publish(void)
+{
+  if (txtail != published) {
+    __atomic_store_n(&shm->ring[self].tail.value, txtail, __ATOMIC_RELEASE);
+    published = txtail;
+    rep->batches++;
+  }
+}
+
+void tolayer5(int AorB, char datasent[20])
+{
+  double latency;
+  int i;
+
+  if (TRACE>2) {
+    printf("          TOLAYER5: data received by application at %c: ", AorB == A ? 'A' : 'B');
+    for (i=0; i<20; i++)
+      printf("%c", datasent[i]);
+    printf("\n");
+  }
+  if (AorB != B)
+    return;
+  /* delivery is in order, so this is message number delivered */
+  latency = now() - shm->taken[shm->delivered % MAXTAKEN];
+  shm->latencysum += latency;
+  if (latency > shm->latencymax)
+    shm->latencymax = latency;
+  __atomic_store_n(&shm->delivered, shm->delivered + 1, __ATOMIC_RELAXED);
+}
+
+void tolayer5v(int AorB, const struct msgspan *spans, int nspans)
+{
+  int i, k;
+
+  for (i=0; i<nspans; i++)
+    for (k=0; k<spans[i].count; k++)
+      tolayer5(AorB, (char *)spans[i].base + k * spans[i].stride);
+}
+
+/* the application takes every message at once */
+int tolayer5_room(int AorB)
+{
+  return INT_MAX;
+}
+
+/* A is a saturated source, backlogged until it has handed out nmsgs */
+int layer5_waiting(int AorB)
+{
+  return AorB == A && generated < nmsgs;
+}
+
+void starttimer(int AorB, double increment)
+{
+  if (TRACE>1)
+    printf("          START TIMER: starting timer\n");
+  if (armed) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
+  armed = 1;
+  deadline = now() + increment * timeunit;
+}
+
+void stoptimer(int AorB)
+{
+  if (TRACE>1)
+    printf("          STOP TIMER: stopping timer\n");
+  if (!armed) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  armed = 0;
+}
+
+/* take everything the other side has published; returns the number taken */
+int consume(void)
+{
+  struct ring *r = &shm->ring[1 - self];
+  struct pkt packet;
+  int n = 0;
+
+  if (rxhead == rxtail) {
+    rxtail = __atomic_load_n(&r->tail.value, __ATOMIC_ACQUIRE);
+    if (rxhead == rxtail)
+      return 0;
+  }
+  while (rxhead != rxtail) {
+    packet = r->slots[rxhead % RINGSIZE].packet;
+    rxhead++;
+    n++;
+    if (self == A)
+      A_input(packet);
+    else
+      B_input(packet);
+  }
+  __atomic_store_n(&r->head.value, rxhead, __ATOMIC_RELEASE);
+  rep->packets_arrived += n;
+  return n;
+}
+
+/* A takes messages for as long as its window has room */
+int feed(void)
+{
+  struct msg msg2give;
+  int i, n = 0;
+
+  while (generated < nmsgs && generated - __atomic_load_n(&shm->delivered, __ATOMIC_RELAXED) < MAXTAKEN &&
+         A_ready()) {
+    for (i=0; i<20; i++)
+      msg2give.data[i] = 97 + generated % 26;
+    shm->taken[generated % MAXTAKEN] = now();
+    generated++;
+    n++;
+    A_output(msg2give);
+  }
+  return n;
+}
+
+void pin(int c)
+{
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(c, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    printf("note: could not pin entity %c to CPU %d\n", self == A ? 'A' : 'B', c);
+}
+
+/* the loop of either entity, until B has delivered all messages */
+void run(void)
+{
+  double t, lastwork;
+  int work;
+
+  rep = &shm->report[self];
+  pin(cpu[self]);
+  if (self == A)
+    A_init();
+  else
+    B_init();
+  lastwork = now();
+  while (!__atomic_load_n(&shm->done.value, __ATOMIC_ACQUIRE)) {
+    work = self == A ? feed() : 0;
+    work += consume();
+    t = now();
+    if (armed && t >= deadline) {
+      armed = 0;
+      rep->timeouts++;
+      work++;
+      if (self == A)
+        A_timerinterrupt();
+      else
+        B_timerinterrupt();
+    }
+    publish();
+    if (self == B && shm->delivered >= nmsgs)
+      __atomic_store_n(&shm->done.value, 1, __ATOMIC_RELEASE);
+    if (work)
+      lastwork = t;
+    else if (t - lastwork > 5e6) {
+      if (self == B)
+        printf("stalled: nothing happened for 5 seconds\n");
+      __atomic_store_n(&shm->done.value, 1, __ATOMIC_RELEASE);
+    }
+    else if (!armed || deadline - t > 100.0)
+      sched_yield();    /* idle: let the other side have a shared CPU */
+  }
+  rep->packets_resent = packets_resent;
+  rep->packets_received = packets_received;
+  rep->window_full = window_full;
+  if (self == A)
+    rep->window = A_window();
+  rep->cpu = cputime();
+}
+
+void usage(void)
+{
+  printf("usage: shm [options]\n");
+  printf("  -n messages                 messages to deliver (default 1000000)\n");
+  printf("  -loss p, -corrupt p         packet loss and corruption probability\n");
+  printf("  -timeunit us                microseconds per protocol time unit (default 10)\n");
+  printf("  -cpus a,b                   CPUs to pin A and B to (default 0,1)\n");
+  printf("  -checksum sum|inet|crc32c   checksum used by the protocol (default sum)\n");
+  printf("  -trace n                    TRACE level of the protocol (default 0)\n");
+  exit(EXIT_FAILURE);
+}
+
+void parseargs(int argc, char **argv)
+{
+  int i;
+
+  for (i=1; i<argc; i++) {
+    if (i+1 == argc)
+      usage();
+    if (strcmp(argv[i], "-n") == 0) {
+      if (sscanf(argv[++i], "%d", &nmsgs) != 1 || nmsgs < 1)
+        usage();
+    }
+    else if (strcmp(argv[i], "-loss") == 0) {
+      if (sscanf(argv[++i], "%lf", &lossprob) != 1 || lossprob < 0.0 || lossprob >= 1.0)
+        usage();
+    }
+    else if (strcmp(argv[i], "-corrupt") == 0) {
+      if (sscanf(argv[++i], "%lf", &corruptprob) != 1 || corruptprob < 0.0 || corruptprob >= 1.0)
+        usage();
+    }
+    else if (strcmp(argv[i], "-timeunit") == 0) {
+      if (sscanf(argv[++i], "%lf", &timeunit) != 1 || timeunit <= 0.0)
+        usage();
+    }
+    else if (strcmp(argv[i], "-cpus") == 0) {
+      if (sscanf(argv[++i], "%d,%d", &cpu[A], &cpu[B]) != 2 || cpu[A] < 0 || cpu[B] < 0 ||
+          cpu[A] >= CPU_SETSIZE || cpu[B] >= CPU_SETSIZE)
+        usage();
+    }
+    else if (strcmp(argv[i], "-checksum") == 0) {
+      if (!checksum_select(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-trace") == 0) {
+      if (sscanf(argv[++i], "%d", &TRACE) != 1)
+        usage();
+    }
+    else
+      usage();
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct report *a, *b;
+  double start, elapsed;
+  pid_t pid;
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  parseargs(argc, argv);
+  checksum_init();
+  if (ncpus > 0) {
+    cpu[A] %= ncpus;    /* both on one CPU if there is only one */
+    cpu[B] %= ncpus;
+  }
+  shm = mmap(NULL, sizeof(struct shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shm == MAP_FAILED) {
+    printf("cannot map the shared segment.\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(shm, 0, sizeof(struct shared));
+
+  fflush(NULL);
+  start = now();
+  pid = fork();
+  if (pid < 0) {
+    printf("cannot fork the receiver.\n");
+    exit(EXIT_FAILURE);
+  }
+  self = pid == 0 ? B : A;
+  srand(9999 + self);
+  run();
+  if (self == B) {
+    fflush(NULL);
+    _exit(EXIT_SUCCESS);
+  }
+  waitpid(pid, NULL, 0);
+  elapsed = now() - start;
+
+  a = &shm->report[A];
+  b = &shm->report[B];
+  printf("shared memory rings: %d of %d messages delivered in %.3f s (A on CPU %d, B on CPU %d)\n",
+         shm->delivered, nmsgs, elapsed / 1e6, cpu[A], cpu[B]);
+  printf("  throughput:  %.0f messages/s, %.0f packets/s (data and ACKs)\n",
+         shm->delivered / (elapsed / 1e6), (a->packets_sent + b->packets_sent) / (elapsed / 1e6));
+  printf("  CPU time per packet handled (sent or received):  A %.3f us, B %.3f us\n",
+         a->cpu / (a->packets_sent + a->packets_arrived + 1),
+         b->cpu / (b->packets_sent + b->packets_arrived + 1));
+  printf("  message latency:  mean %.2f us, max %.1f us\n",
+         shm->delivered ? shm->latencysum / shm->delivered : 0.0, shm->latencymax);
+  printf("  packets sent by A %ld, by B %ld; lost %ld, corrupted %ld, lost to a full ring %ld\n",
+         a->packets_sent, b->packets_sent, a->packets_lost + b->packets_lost,
+         a->packets_corrupt + b->packets_corrupt, a->ring_full + b->ring_full);
+  printf("  packet resends by A %d, timeouts %ld, correct packets received at B %d\n",
+         a->packets_resent, a->timeouts, b->packets_received);
+  printf("  ring batches published:  A %ld (%.1f packets each), B %ld (%.1f packets each)\n",
+         a->batches, a->batches ? (double)(a->packets_sent - a->packets_lost) / a->batches : 0.0,
+         b->batches, b->batches ? (double)(b->packets_sent - b->packets_lost) / b->batches : 0.0);
+#ifdef AUTOWINDOW
+  printf("  window of A at the end:  %d\n", a->window);
+#endif
+  return EXIT_SUCCESS;
+}
@@ -1,7 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 #include "emulator.h"
+#include "checksum.h"
 #include "sr.h"
 
 /* ******************************************************************
@@ -24,10 +26,65 @@
 
 #define RTT  16.0       /* round trip time.  MUST BE SET TO 16.0 when submitting assignment */
 #define WINDOWSIZE 6    /* the maximum number of buffered unacked packet */
+#ifdef RCVBUF           /* packets B can buffer, -DRCVBUF=n to size it */
+#ifndef FLOWCONTROL
+#error "-DRCVBUF needs -DFLOWCONTROL, whose advertised window keeps A within the buffer"
+#endif
+#define SEQSPACE (WINDOWSIZE + RCVBUF)
+#else
+#define RCVBUF WINDOWSIZE
 #define SEQSPACE 12      /* the min sequence space for GBN must be at least windowsize + 1 */
                         /* The minimum for selective repeat is WINDOWSIZE * 2*/
+#endif
 #define NOTINUSE (-1)   /* used to fill header fields that are not being used */
 
+/* sequence number wrap, a mask when SEQSPACE is a power of two */
+#if (SEQSPACE & (SEQSPACE - 1)) == 0
+#define SEQWRAP(x) ((x) & (SEQSPACE - 1))
+#else
+#define SEQWRAP(x) ((x) % SEQSPACE)
+#endif
+
+/* A -DNACK build lets B ask for the packets it finds missing: an ACK
+   for a packet beyond a gap names the gap (payload "N", then its first
+   sequence number and length as 16 bit numbers) and A resends those
+   packets at once, each at most once until the timer resends it, instead
+   of waiting for the timer on send_base.  The gap below a packet is
+   only reported the first time B sees a packet that far ahead. */
+
+/* B holds the packets its application cannot take yet (a slow consumer,
+   see tolayer5_room()) in buffer_for_B, and its receive window only moves
+   on as the application takes them.  A -DFLOWCONTROL build has B
+   advertise that window in every ACK (payload byte 5 "W", then the first
+   sequence number not handed to the application as a 16 bit number, the
+   window being the RCVBUF packets from there) and A sends nothing beyond it.
+   When the application frees a full buffer B sends the new window at
+   once; if that is lost, A's timer probes a closed window by resending
+   the packet below send_base, which B acknowledges with its window. */
+
+/* the ACK state of both windows is a packed bitmap, one bit per sequence number */
+#define WORDBITS ((int)(8 * sizeof(unsigned long)))
+#define MAPWORDS ((SEQSPACE + WORDBITS - 1) / WORDBITS)
+
+/* linked beside gbn.c, every global name gets an sr_ prefix */
+#ifdef MULTIPROTOCOL
+#define ComputeChecksum sr_ComputeChecksum
+#define IsCorrupted sr_IsCorrupted
+#define isInRange sr_isInRange
+#define A_init sr_A_init
+#define B_init sr_B_init
+#define A_input sr_A_input
+#define B_input sr_B_input
+#define A_output sr_A_output
+#define A_ready sr_A_ready
+#define A_inflight sr_A_inflight
+#define A_window sr_A_window
+#define A_timerinterrupt sr_A_timerinterrupt
+#define B_output sr_B_output
+#define B_timerinterrupt sr_B_timerinterrupt
+#define B_appready sr_B_appready
+#endif
+
 /* generic procedure to compute the checksum of a packet.  Used by both sender and receiver  
    the simulator will overwrite part of your packet with 'z's.  It will not overwrite your 
    original checksum.  This procedure must generate a different checksum to the original if
@@ -35,25 +92,69 @@
 */
 int ComputeChecksum(struct pkt packet)
 {
-  int checksum = 0;
-  int i;
-
-  checksum = packet.seqnum;
-  checksum += packet.acknum;
-  for ( i=0; i<20; i++ ) 
-    checksum += (int)(packet.payload[i]);
-
-  return checksum;
+  /* byte sum, Internet checksum or CRC32C as selected by -checksum */
+  return pkt_checksum(&packet);
 }
 
+/* a header field outside the sequence space can only come from bit
+   errors the checksum missed, and would index past the buffers */
 bool IsCorrupted(struct pkt packet)
 {
+  if (packet.seqnum < NOTINUSE || packet.seqnum >= SEQSPACE ||
+      packet.acknum < NOTINUSE || packet.acknum >= SEQSPACE)
+    return (true);
   if (packet.checksum == ComputeChecksum(packet))
     return (false);
   else
     return (true);
 }
 
+static int bit_test(const unsigned long *map, int seq)
+{
+  return (map[seq / WORDBITS] >> (seq % WORDBITS)) & 1;
+}
+
+static void bit_set(unsigned long *map, int seq)
+{
+  map[seq / WORDBITS] |= 1UL << (seq % WORDBITS);
+}
+
+static void bit_clear(unsigned long *map, int seq)
+{
+  map[seq / WORDBITS] &= ~(1UL << (seq % WORDBITS));
+}
+
+/* clears the run of set bits starting at seq, wrapping around at
+   SEQSPACE, and returns its length, at most max; a word at a time,
+   counting its trailing ones */
+static int take_run(unsigned long *map, int seq, int max)
+{
+  unsigned long word;
+  int n = 0, bit, avail, ones;
+
+  if (max > SEQSPACE)
+    max = SEQSPACE;
+  while (n < max) {
+    bit = seq % WORDBITS;
+    avail = WORDBITS - bit;
+    if (avail > SEQSPACE - seq)
+      avail = SEQSPACE - seq;
+    if (avail > max - n)
+      avail = max - n;
+    word = map[seq / WORDBITS] >> bit;
+    ones = ~word == 0 ? WORDBITS : __builtin_ctzl(~word);
+    if (ones > avail)
+      ones = avail;
+    if (ones > 0)
+      map[seq / WORDBITS] &= ~((ones == WORDBITS ? ~0UL : (1UL << ones) - 1) << bit);
+    n += ones;
+    seq = SEQWRAP(seq + ones);
+    if (ones < avail)
+      break;
+  }
+  return n;
+}
+
 bool isInRange(int seq, int start, int end) {
   if (start <= end)
     return seq >= start && seq < end;
@@ -64,12 +165,42 @@ bool isInRange(int seq, int start, int end) {
 
 /********* Sender (A) variables and functions ************/
 
-static struct pkt buffer[SEQSPACE];  /* array for storing packets waiting for ACK */
-static int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
-static int windowcount;                /* the number of packets currently awaiting an ACK */
-static int A_nextseqnum;               /* the next sequence number to be used by the sender */
-static int ACKarray[SEQSPACE];
-static int send_base;
+struct sender {
+  struct pkt buffer[SEQSPACE];  /* array for storing packets waiting for ACK */
+  int windowfirst, windowlast;    /* array indexes of the first/last packet awaiting ACK */
+  int windowcount;                /* the number of packets currently awaiting an ACK */
+  int A_nextseqnum;               /* the next sequence number to be used by the sender */
+  unsigned long ACKarray[MAPWORDS];  /* bit set: ACKed */
+  int send_base;
+#ifdef NACK
+  unsigned long NACKarray[MAPWORDS];  /* bit set: resent for a NACK */
+#endif
+#ifdef FLOWCONTROL
+  int rcvbase;                    /* start of B's receive window, from its ACKs */
+  int probing;                    /* the timer probes a closed receive window */
+#endif
+};
+
+static struct sender *senders = NULL;  /* sender state of every flow */
+
+/* Room in A's window.  Counting only the packets awaiting an ACK lets A
+   run ahead of send_base by more than the window, until B takes an old
+   copy of a sequence number for a new packet, so A measures the window
+   from send_base and matches ACKs only against what it has sent. */
+#define WINDOWOPEN(s) (SEQWRAP((s)->A_nextseqnum - (s)->send_base + SEQSPACE) < WINDOWSIZE)
+
+#ifdef FLOWCONTROL
+/* whether B's receive window has room for A's next packet */
+static int rwnd_open(const struct sender *s)
+{
+  return SEQWRAP(s->A_nextseqnum - s->rcvbase + SEQSPACE) < RCVBUF;
+}
+
+/* A sends a new packet only within both windows */
+#define CANSEND(s) (WINDOWOPEN(s) && rwnd_open(s))
+#else
+#define CANSEND(s) WINDOWOPEN(s)
+#endif
 
 /* called from layer 5 (application layer), passed the message to be sent to other side */
 /*message is a structure containing data to be sent to B. This routine will be called 
@@ -78,11 +209,12 @@ It is the job of the reliable transport protocol to insure that the data in such
 is delivered in-order, and correctly, to the receiving side upper layer. */
 void A_output(struct msg message)
 {
+  struct sender *s = &senders[current_flow];
   struct pkt sendpkt;
   int i;
 
   /* if not blocked waiting on ACK */
-  if ( windowcount < WINDOWSIZE) {
+  if (CANSEND(s)) {
 
     /*Keep this the same*/
 
@@ -90,7 +222,7 @@ void A_output(struct msg message)
       printf("----A: New message arrives, send window is not full, send new messge to layer3!\n");
 
     /* create packet */
-    sendpkt.seqnum = A_nextseqnum; /*The current sequence number of the new packet becomes the next sequence number*/
+    sendpkt.seqnum = s->A_nextseqnum; /*The current sequence number of the new packet becomes the next sequence number*/
     sendpkt.acknum = NOTINUSE;
     /*Load data into payload*/
     for (i=0; i<20 ; i++ ) 
@@ -109,9 +241,12 @@ void A_output(struct msg message)
     /*windowlast = (windowlast + 1) % WINDOWSIZE;*/
     /*To add the packet into the buffer and ACKarray to keep track
     of the ACK*/
-    buffer[A_nextseqnum] = sendpkt;
-    ACKarray[A_nextseqnum] = 0;
-    windowcount++;
+    s->buffer[s->A_nextseqnum] = sendpkt;
+    bit_clear(s->ACKarray, s->A_nextseqnum);
+#ifdef NACK
+    bit_clear(s->NACKarray, s->A_nextseqnum);
+#endif
+    s->windowcount++;
 
     /*////////////////////////////////////////
 
@@ -128,7 +263,7 @@ void A_output(struct msg message)
     // May need different timer, or use 1 timer as multiples*/
 
     /* start timer if it is the send_base packet */
-    if (sendpkt.seqnum == send_base) {
+    if (sendpkt.seqnum == s->send_base) {
       starttimer(A,RTT);
     }
 
@@ -136,7 +271,7 @@ void A_output(struct msg message)
 
 
     /* get next sequence number, wrap back to 0 */
-    A_nextseqnum = (A_nextseqnum + 1) % SEQSPACE; /*//Get the next sequence number for the next packet
+    s->A_nextseqnum = SEQWRAP(s->A_nextseqnum + 1); /*//Get the next sequence number for the next packet
                                                   //Sequence number has to be larger than window size 
                                                   //+1 to prevent confusion
                                                   //But for selective repeat, the SEQSPACE has to be double
@@ -155,6 +290,85 @@ void A_output(struct msg message)
 }
 
 
+/* whether A_output would take a message now, for backlogged sources */
+int A_ready(void)
+{
+  return CANSEND(&senders[current_flow]);
+}
+
+
+/* packets A has sent and not yet seen acknowledged, for statistics */
+int A_inflight(void)
+{
+  return senders[current_flow].windowcount;
+}
+
+
+/* packets A lets be awaiting an ACK now, for the report */
+int A_window(void)
+{
+  return WINDOWSIZE;
+}
+
+
+#ifdef NACK
+/* resend the packets a NACK names that are still waiting for their ACK */
+static void resend_nacked(struct sender *s, struct pkt packet)
+{
+  const unsigned char *p = (const unsigned char *)packet.payload;
+  int first, count, seq, i;
+
+  if (packet.payload[0] != 'N')
+    return;
+  first = (p[1] << 8) | p[2];
+  count = (p[3] << 8) | p[4];
+  if (first >= SEQSPACE || count < 1 || count >= WINDOWSIZE)
+    return;
+  for (i = 0; i < count; i++) {
+    seq = SEQWRAP(first + i);
+    if (!isInRange(seq, s->send_base, s->A_nextseqnum) || bit_test(s->ACKarray, seq) ||
+        bit_test(s->NACKarray, seq))
+      continue;
+    if (TRACE > 0)
+      printf("---A: NACK for packet %d, resending it\n", seq);
+    bit_set(s->NACKarray, seq);
+    packets_resent++;
+    tolayer3(A, s->buffer[seq]);
+    if (seq == s->send_base) {
+      stoptimer(A);
+      starttimer(A, RTT);
+    }
+  }
+}
+#endif
+
+#ifdef FLOWCONTROL
+/* take B's receive window from an ACK, and have the timer probe it
+   while it is closed and no packet awaiting an ACK will bring a new one */
+static void update_rwnd(struct sender *s, struct pkt packet)
+{
+  const unsigned char *p = (const unsigned char *)packet.payload;
+  int base;
+
+  if (packet.payload[5] == 'W') {
+    base = (p[6] << 8) | p[7];
+    /* it only moves forward, and never past what A has sent */
+    if (base < SEQSPACE && SEQWRAP(base - s->rcvbase + SEQSPACE) <= SEQWRAP(s->A_nextseqnum - s->rcvbase + SEQSPACE))
+      s->rcvbase = base;
+  }
+  if (s->windowcount == 0 && !rwnd_open(s) && !s->probing) {
+    if (TRACE > 0)
+      printf("----A: receive window of B is closed, probe it\n");
+    s->probing = 1;
+    starttimer(A, RTT);
+  }
+  else if (s->probing && rwnd_open(s)) {
+    s->probing = 0;
+    stoptimer(A);
+  }
+}
+#endif
+
 /* called from layer 3, when a packet arrives for layer 4 
    In this practical this will always be an ACK as B never sends data.
 */
@@ -163,8 +377,11 @@ void A_output(struct msg message)
 arrives at A. packet is the (possibly corrupted) packet sent from B.*/
 void A_input(struct pkt packet)
 { /*//This is for A receiving a packet from B*/
+  struct sender *s = &senders[current_flow];
   int ACKnum = packet.acknum;
-  int seqlast = (send_base + WINDOWSIZE - 1) % SEQSPACE;
+  /* only what A has sent: B acknowledges the duplicates below its window,
+     whose numbers the window of A may already cover again */
+  int seqlast = SEQWRAP(s->A_nextseqnum + SEQSPACE - 1);
 
   /*//If an ACK is received, the SR sender marks that packet as having been received,
   //provided it is in the window. If the packet’s sequence number is equal to send_
@@ -182,12 +399,12 @@ void A_input(struct pkt packet)
     total_ACKs_received++; /*Not sure about this*/
     
     /* check if new ACK or duplicate */
-    if (windowcount != 0) { /*If there are still packets awaiting ACK*/
+    if (s->windowcount != 0) { /*If there are still packets awaiting ACK*/
 
        /* check case when seqnum has and hasn't wrapped */
-      if (((send_base <= seqlast) && (packet.acknum >= send_base && packet.acknum <= seqlast)) ||
-      ((send_base > seqlast) && (packet.acknum >= send_base || packet.acknum <= seqlast))) {
-        if (ACKarray[ACKnum] == 0) {
+      if (((s->send_base <= seqlast) && (packet.acknum >= s->send_base && packet.acknum <= seqlast)) ||
+      ((s->send_base > seqlast) && (packet.acknum >= s->send_base || packet.acknum <= seqlast))) {
+        if (!bit_test(s->ACKarray, ACKnum)) {
           /*If the ACK is new*/
           /* packet is a new ACK */
           if (TRACE > 0) {
@@ -199,7 +416,7 @@ void A_input(struct pkt packet)
           /*stoptimer(A);*/
 
           /*To turn the bit in the ACKarray for that packet to 1*/
-          ACKarray[ACKnum] = 1;
+          bit_set(s->ACKarray, ACKnum);
 
           
 
@@ -212,20 +429,15 @@ void A_input(struct pkt packet)
 
 
           /* delete the acked packets from windowcount */
-          windowcount--;
+          s->windowcount--;
           
-          /*This is to move the send_base forward for all the ACKed*/
-          while (ACKarray[send_base] == 1) {
-            /*Reset the ACK value to 0*/
-            ACKarray[send_base] = 0;
-            /*Increment the send_base*/
-            send_base = (send_base + 1) % SEQSPACE;
-          }
+          /*This is to move the send_base forward for all the ACKed, resetting their bits*/
+          s->send_base = SEQWRAP(s->send_base + take_run(s->ACKarray, s->send_base, SEQSPACE));
           
           /*When the send_base is the same with the A_nextseqnum, this is the last packet*/
-          if (send_base == A_nextseqnum) {
+          if (s->send_base == s->A_nextseqnum) {
             stoptimer(A);
-          } else if (send_base != A_nextseqnum) {
+          } else if (s->send_base != s->A_nextseqnum) {
             stoptimer(A);
             starttimer(A,RTT);
           }
@@ -244,6 +456,12 @@ void A_input(struct pkt packet)
       } else
         if (TRACE > 0)
       printf ("----A: duplicate ACK received, do nothing!\n");
+#ifdef NACK
+    resend_nacked(s, packet);
+#endif
+#ifdef FLOWCONTROL
+    update_rwnd(s, packet);
+#endif
   }
   else 
     if (TRACE > 0)
@@ -257,8 +475,20 @@ void A_input(struct pkt packet)
  below for how the timer is started and stopped.*/
 void A_timerinterrupt(void)
 {
+  struct sender *s = &senders[current_flow];
   /*int i;*/
 
+#ifdef FLOWCONTROL
+  /* nothing to resend: the packet below send_base asks B for its window */
+  if (s->probing) {
+    if (TRACE > 0)
+      printf("----A: probing the closed receive window of B\n");
+    tolayer3(A, s->buffer[SEQWRAP(s->send_base + SEQSPACE - 1)]);
+    starttimer(A, RTT);
+    return;
+  }
+#endif
+
   if (TRACE > 0) {
     printf("----A: time out,resend packets!\n");
   }
@@ -281,10 +511,13 @@ void A_timerinterrupt(void)
       /*///////////////////////////////////////////*/
 
       if (TRACE > 0) {
-        printf ("---A: resending packet %d\n", (buffer[send_base].seqnum));
+        printf ("---A: resending packet %d\n", (s->buffer[s->send_base].seqnum));
       }
 
-      tolayer3(A,buffer[send_base]);
+      tolayer3(A,s->buffer[s->send_base]);
+#ifdef NACK
+      bit_clear(s->NACKarray, s->send_base);  /* a NACK may ask for it again */
+#endif
       /*stoptimer(A);*/
 
     /* Start the timer*/
@@ -297,22 +530,40 @@ void A_timerinterrupt(void)
 /* entity A routines are called. You can use it to do any initialization */
 void A_init(void)
 {
+  struct sender *s;
   int i;
 
+  /* the first flow to start allocates the state of all of them */
+  if (senders == NULL) {
+    senders = calloc(nflows, sizeof(struct sender));
+    if (senders == NULL) {
+      printf("memory allocation for sender state failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  s = &senders[current_flow];
+
   /* initialise A's window, buffer and sequence number */
-  A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
-  windowfirst = 0;
-  windowlast = -1;   /* windowlast is where the last packet sent is stored.  
+  s->A_nextseqnum = 0;  /* A starts with seq num 0, do not change this */
+  s->windowfirst = 0;
+  s->windowlast = -1;   /* windowlast is where the last packet sent is stored.  
 		     new packets are placed in winlast + 1 
 		     so initially this is set to -1
 		   */
-  windowcount = 0;
+  s->windowcount = 0;
 
-  send_base = 0;
+  s->send_base = 0;
+#ifdef FLOWCONTROL
+  s->rcvbase = 0;
+  s->probing = 0;
+#endif
   
-  for (i = 0; i< WINDOWSIZE; i++) {
-    ACKarray[i] = 0; /*This array is used for keeping track of al the ACKs
+  for (i = 0; i< MAPWORDS; i++) {
+    s->ACKarray[i] = 0; /*This bitmap is used for keeping track of al the ACKs
                                     0: is not ACKed and 1: is ACKed*/
+#ifdef NACK
+    s->NACKarray[i] = 0;
+#endif
   }
   
 }
@@ -321,11 +572,89 @@ void A_init(void)
 
 /********* Receiver (B)  variables and procedures ************/
 
-static int expectedseqnum; /* the sequence number expected next by the receiver */
-static int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+struct receiver {
+  int expectedseqnum; /* the sequence number expected next by the receiver */
+  int B_nextseqnum;   /* the sequence number for the next packets sent by B */
+  struct pkt buffer_for_B[SEQSPACE];  /* array for storing packets waiting for ACK */
+  unsigned long ACKarray_for_B[MAPWORDS];  /* bit set: buffered */
+#ifdef NACK
+  int frontier;       /* the sequence number after the highest one received */
+#endif
+};
 
-static struct pkt buffer_for_B[SEQSPACE];  /* array for storing packets waiting for ACK */
-static int ACKarray_for_B[SEQSPACE];
+static struct receiver *receivers = NULL;  /* receiver state of every flow */
+static struct pkt ACKtemplate;  /* payload of 0's with its checksum, copied for every ACK */
+#ifdef FLOWCONTROL
+static struct pkt WNDtemplate[SEQSPACE];  /* the same advertising each receive window */
+#endif
+
+/* hands the run of packets from expectedseqnum on to layer 5, as many as
+   the application takes now, in one call (at most two runs of the buffer
+   as it wraps around at SEQSPACE) and moves the receive window past them;
+   returns how many */
+static int deliver_run(struct receiver *r)
+{
+  struct msgspan spans[2];
+  int nspans = 1, run;
+
+  if (!bit_test(r->ACKarray_for_B, r->expectedseqnum))
+    return 0;
+  run = take_run(r->ACKarray_for_B, r->expectedseqnum, tolayer5_room(B));
+  if (run == 0)
+    return 0;
+  spans[0].base = r->buffer_for_B[r->expectedseqnum].payload;
+  spans[0].count = run;
+  spans[0].stride = sizeof(struct pkt);
+  if (run > SEQSPACE - r->expectedseqnum) {
+    spans[0].count = SEQSPACE - r->expectedseqnum;
+    spans[1].base = r->buffer_for_B[0].payload;
+    spans[1].count = run - spans[0].count;
+    spans[1].stride = sizeof(struct pkt);
+    nspans = 2;
+  }
+  /*Increment the expectedseqnum past them*/
+  r->expectedseqnum = SEQWRAP(r->expectedseqnum + run);
+  /*Send the correct packets to layer 5*/
+  tolayer5v(B, spans, nspans);
+  return run;
+}
+
+#ifdef FLOWCONTROL
+/* packets B holds, delivered to it and not yet to the application */
+static int held(const struct receiver *r)
+{
+  int i, n = 0;
+
+  for (i = 0; i < MAPWORDS; i++)
+    n += __builtin_popcountl(r->ACKarray_for_B[i]);
+  return n;
+}
+
+/* puts B's receive window into an ACK whose header is filled in: the
+   payload comes from the window's template, whose checksum is adjusted
+   for the header */
+static void advertise(const struct receiver *r, struct pkt *ack)
+{
+  const struct pkt *t = &WNDtemplate[r->expectedseqnum];
+
+  memcpy(ack->payload, t->payload, sizeof(ack->payload));
+  ack->checksum = pkt_checksum_adjust(t, ack->seqnum, ack->acknum);
+}
+#else
+/* whether seq is a new packet beyond B's buffer.  The packets held for
+   a busy application were acknowledged, so A's window may reach up to
+   WINDOWSIZE past the first packet B has not received, while B holds
+   only RCVBUF from expectedseqnum on. */
+static int beyond_buffer(const struct receiver *r, int seq)
+{
+  int first = r->expectedseqnum, n;
+
+  for (n = 0; n < RCVBUF && bit_test(r->ACKarray_for_B, first); n++)
+    first = SEQWRAP(first + 1);
+  return SEQWRAP(seq - first + SEQSPACE) < WINDOWSIZE &&
+         SEQWRAP(seq - r->expectedseqnum + SEQSPACE) >= RCVBUF;
+}
+#endif
 
 
 
@@ -340,8 +669,11 @@ It is important to note that in Step 2 in Figure 3.25, the receiver reacknowledg
 the current window base.*/
 void B_input(struct pkt packet)
 {
+  struct receiver *r = &receivers[current_flow];
   struct pkt sendpkt;
-  int i;
+#ifdef NACK
+  int nackfirst = 0, nackcount = 0;
+#endif
 
   /* if not corrupted and received packet is in order 
   The SR receiver will acknowledge a correctly received packet whether or not it is in
@@ -365,36 +697,47 @@ void B_input(struct pkt packet)
   /*int lower_duplicate_edge = ((expectedseqnum - WINDOWSIZE) + SEQSPACE) % SEQSPACE;*/
 
   
+#ifndef FLOWCONTROL
+  /* not acknowledged, so A resends it once the application took some */
+  if (!IsCorrupted(packet) && beyond_buffer(r, packet.seqnum)) {
+    if (TRACE > 0)
+      printf("----B: packet %d is beyond the receive buffer, do nothing!\n", packet.seqnum);
+    return;
+  }
+#endif
+
   if  (!IsCorrupted(packet)) {
 
     int SEQnum = packet.seqnum;
-    int seqlast = (expectedseqnum + WINDOWSIZE - 1) % SEQSPACE;
+    int seqlast = SEQWRAP(r->expectedseqnum + RCVBUF - 1);
     if (TRACE > 0)
       printf("----B: packet %d is correctly received, send ACK!\n",packet.seqnum);
     packets_received++;
 
     /*Check if the packet is within the window, and for the wrap around*/
-    if (((expectedseqnum <= seqlast) && (packet.seqnum >= expectedseqnum && packet.seqnum <= seqlast)) ||
-      ((expectedseqnum > seqlast) && (packet.seqnum >= expectedseqnum || packet.seqnum <= seqlast))) {
+    if (((r->expectedseqnum <= seqlast) && (packet.seqnum >= r->expectedseqnum && packet.seqnum <= seqlast)) ||
+      ((r->expectedseqnum > seqlast) && (packet.seqnum >= r->expectedseqnum || packet.seqnum <= seqlast))) {
+
+#ifdef NACK
+        /*The packets between the highest one received so far and this one are missing*/
+        if (SEQWRAP(SEQnum - r->expectedseqnum + SEQSPACE) >= SEQWRAP(r->frontier - r->expectedseqnum + SEQSPACE)) {
+          nackfirst = r->frontier;
+          nackcount = SEQWRAP(SEQnum - r->frontier + SEQSPACE);
+          r->frontier = SEQWRAP(SEQnum + 1);
+        }
+#endif
 
         /*If the packet is new*/
-        if (ACKarray_for_B[SEQnum] == 0) {
+        if (!bit_test(r->ACKarray_for_B, SEQnum)) {
           /*Save it into the buffer*/
-          buffer_for_B[SEQnum] = packet;
+          r->buffer_for_B[SEQnum] = packet;
           /*Mark it received*/
-          ACKarray_for_B[SEQnum] = 1;
+          bit_set(r->ACKarray_for_B, SEQnum);
         }
 
-        /*This is to move the receive_base forward and send all the correctly received packets */
-        while (ACKarray_for_B[expectedseqnum] == 1) {
-          /*Send the correct packets to layer 5*/
-          tolayer5(B, buffer_for_B[expectedseqnum].payload);
-          /*Reset the ACK value to 0*/
-          ACKarray_for_B[expectedseqnum] = 0;
-          /*Increment the expectedseqnum*/
-          expectedseqnum = (expectedseqnum + 1) % SEQSPACE;
-
-        }
+        /*This is to move the receive_base forward and send the correctly received packets
+        the application takes to layer 5*/
+        deliver_run(r);
     }
     /* send an ACK for the received packet */
     sendpkt.acknum = packet.seqnum;
@@ -428,19 +771,28 @@ void B_input(struct pkt packet)
 
   }
 
-  /* create packet */
-  sendpkt.seqnum = B_nextseqnum;
-  B_nextseqnum = (B_nextseqnum + 1) % 2;
-
-
-  
-  /*Keep this*/
-  /* we don't have any data to send.  fill payload with 0's */
-  for ( i=0; i<20 ; i++ ) 
-    sendpkt.payload[i] = '0';  
-
-  /* computer checksum */
-  sendpkt.checksum = ComputeChecksum(sendpkt); 
+  /* create packet from the template, only the header changes so the
+     checksum is adjusted instead of recomputed over the payload */
+  sendpkt.seqnum = r->B_nextseqnum;
+  r->B_nextseqnum = (r->B_nextseqnum + 1) % 2;
+#ifdef FLOWCONTROL
+  advertise(r, &sendpkt);
+#else
+  memcpy(sendpkt.payload, ACKtemplate.payload, sizeof(sendpkt.payload));
+  sendpkt.checksum = pkt_checksum_adjust(&ACKtemplate, sendpkt.seqnum, sendpkt.acknum);
+#endif
+#ifdef NACK
+  if (nackcount > 0) {
+    if (TRACE > 0)
+      printf("----B: packets %d to %d missing, send NACK!\n", nackfirst, SEQWRAP(nackfirst + nackcount - 1));
+    sendpkt.payload[0] = 'N';
+    sendpkt.payload[1] = (char)(nackfirst >> 8);
+    sendpkt.payload[2] = (char)nackfirst;
+    sendpkt.payload[3] = (char)(nackcount >> 8);
+    sendpkt.payload[4] = (char)nackcount;
+    sendpkt.checksum = ComputeChecksum(sendpkt);
+  }
+#endif
 
   /* send out packet */
   tolayer3 (B, sendpkt);
@@ -450,12 +802,42 @@ void B_input(struct pkt packet)
 /* entity B routines are called. You can use it to do any initialization */
 void B_init(void)
 {
+  struct receiver *r;
   int i;
-  expectedseqnum = 0;
-  B_nextseqnum = 1;
 
-  for (i = 0; i< WINDOWSIZE; i++) {
-    ACKarray_for_B[i] = 0; /*This array is used for keeping track of al the ACKs
+  if (receivers == NULL) {
+    receivers = calloc(nflows, sizeof(struct receiver));
+    if (receivers == NULL) {
+      printf("memory allocation for receiver state failed.");
+      exit(EXIT_FAILURE);
+    }
+  }
+  r = &receivers[current_flow];
+
+  r->expectedseqnum = 0;
+  r->B_nextseqnum = 1;
+#ifdef NACK
+  r->frontier = 0;
+#endif
+
+  /* we don't have any data to send.  fill payload with 0's */
+  ACKtemplate.seqnum = 0;
+  ACKtemplate.acknum = 0;
+  for (i=0; i<20; i++)
+    ACKtemplate.payload[i] = '0';
+  ACKtemplate.checksum = ComputeChecksum(ACKtemplate);
+#ifdef FLOWCONTROL
+  for (i=0; i<SEQSPACE; i++) {
+    WNDtemplate[i] = ACKtemplate;
+    WNDtemplate[i].payload[5] = 'W';
+    WNDtemplate[i].payload[6] = (char)(i >> 8);
+    WNDtemplate[i].payload[7] = (char)i;
+    WNDtemplate[i].checksum = ComputeChecksum(WNDtemplate[i]);
+  }
+#endif
+
+  for (i = 0; i< MAPWORDS; i++) {
+    r->ACKarray_for_B[i] = 0; /*This array is used for keeping track of al the ACKs
                                     0: is not ACKed and 1: is ACKed*/
   }
 }
@@ -474,6 +856,32 @@ void B_timerinterrupt(void)
 {
 }
 
+/* called when B's application can take a message again: hand it the
+   next one held for it */
+void B_appready(void)
+{
+  struct receiver *r = &receivers[current_flow];
+#ifdef FLOWCONTROL
+  struct pkt sendpkt;
+  int full = held(r) == RCVBUF;
+#endif
+
+  if (deliver_run(r) == 0)
+    return;
+#ifdef FLOWCONTROL
+  /* A may have stopped at the full window, tell it that it opened */
+  if (full) {
+    if (TRACE > 0)
+      printf("----B: receive window opens at %d, send window update!\n", r->expectedseqnum);
+    sendpkt.seqnum = r->B_nextseqnum;
+    r->B_nextseqnum = (r->B_nextseqnum + 1) % 2;
+    sendpkt.acknum = SEQWRAP(r->expectedseqnum + SEQSPACE - 1);
+    advertise(r, &sendpkt);
+    tolayer3(B, sendpkt);
+  }
+#endif
+}
+
 
 /*The unit of data passed between the application layer and the
  transport layer protocol is a message, which is declared as: 
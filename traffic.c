@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "emulator.h"
+#include "traffic.h"
+
+/* ******************************************************************
+   Traffic generators for the messages layer 5 hands to the senders.
+
+   The uniform, Poisson and CBR sources only differ in how they draw the
+   gap to a flow's next message.  The on/off source alternates ON periods
+   with heavy-tailed (Pareto) lengths, during which messages arrive with
+   exponential gaps, and exponential OFF periods of silence; every ON
+   period starts with a message.  A trace replays a file of timestamps
+   and message sizes one line at a time, so traces of any length can be
+   used; lines without a flow column are dealt to the flows round robin.
+**********************************************************************/
+
+#define TRAFFIC_UNIFORM 0
+#define TRAFFIC_POISSON 1
+#define TRAFFIC_CBR     2
+#define TRAFFIC_ONOFF   3
+#define TRAFFIC_TRACE   4
+
+static int traffic = TRAFFIC_UNIFORM;
+static double meangap;               /* lambda */
+
+static double onmean, offmean, alpha;
+static double *onend;                /* end of each flow's ON period, -1 before the first */
+
+static char tracename[256];
+static FILE *tracefile;
+static long traceline = 0;
+static int tracenext = 0;            /* flow for the next line without a flow column */
+
+
+int traffic_configure(const char *spec)
+{
+  if (strcmp(spec, "uniform") == 0)
+    traffic = TRAFFIC_UNIFORM;
+  else if (strcmp(spec, "poisson") == 0)
+    traffic = TRAFFIC_POISSON;
+  else if (strcmp(spec, "cbr") == 0)
+    traffic = TRAFFIC_CBR;
+  else if (strncmp(spec, "onoff:", 6) == 0) {
+    traffic = TRAFFIC_ONOFF;
+    if (sscanf(spec + 6, "%lf,%lf,%lf", &onmean, &offmean, &alpha) != 3)
+      return 0;
+    return onmean > 0.0 && offmean >= 0.0 && alpha > 1.0;
+  }
+  else if (strncmp(spec, "trace:", 6) == 0 && spec[6] != '\0'
+           && strlen(spec + 6) < sizeof(tracename)) {
+    traffic = TRAFFIC_TRACE;
+    strcpy(tracename, spec + 6);
+  }
+  else
+    return 0;
+  return 1;
+}
+
+int traffic_trace(void)
+{
+  return traffic == TRAFFIC_TRACE;
+}
+
+void traffic_init(double lambda)
+{
+  int f;
+
+  meangap = lambda;
+  if (traffic == TRAFFIC_ONOFF) {
+    onend = malloc(nflows * sizeof(double));
+    if (onend == 0) {
+      printf("memory allocation for traffic failed.");
+      exit(EXIT_FAILURE);
+    }
+    for (f=0; f<nflows; f++)
+      onend[f] = -1.0;
+  }
+  if (traffic == TRAFFIC_TRACE) {
+    tracefile = fopen(tracename, "r");
+    if (tracefile == NULL) {
+      printf("cannot open traffic trace %s.\n", tracename);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+/* exponential with the given mean */
+static double expgap(double mean)
+{
+  double u = 1.0 - jimsrand();
+
+  if (u < 1e-12)
+    u = 1e-12;
+  return -mean * log(u);
+}
+
+/* Pareto with shape alpha > 1 and the given mean */
+static double pareto(double mean)
+{
+  double u = 1.0 - jimsrand();
+
+  if (u < 1e-12)
+    u = 1e-12;
+  return mean * (alpha - 1.0) / alpha / pow(u, 1.0 / alpha);
+}
+
+static double onoff_next(int flow, double now)
+{
+  double t;
+
+  if (onend[flow] < 0.0)                  /* flows start in an ON period */
+    onend[flow] = now + pareto(onmean);
+  t = now + expgap(meangap);
+  if (t < onend[flow])
+    return t;
+  t = onend[flow] + expgap(offmean);      /* silent until the next ON period */
+  onend[flow] = t + pareto(onmean);
+  return t;
+}
+
+/* next "time size [flow]" line of the trace, 0 at its end */
+static int trace_next(int *flow, double now, double *when, int *bytes)
+{
+  char line[256];
+  int f, n;
+
+  while (fgets(line, sizeof(line), tracefile) != NULL) {
+    traceline++;
+    n = sscanf(line, "%lf %d %d", when, bytes, &f);
+    if (n <= 0 || line[strspn(line, " \t")] == '#')
+      continue;                           /* blank line or comment */
+    if (n < 2 || *bytes < 0 || (n == 3 && (f < 0 || f >= nflows))) {
+      printf("traffic trace %s line %ld: expected \"time size [flow]\".\n", tracename, traceline);
+      exit(EXIT_FAILURE);
+    }
+    if (n < 3) {
+      f = tracenext;
+      tracenext = (tracenext + 1) % nflows;
+    }
+    if (*when < now)                      /* out of order lines arrive at once */
+      *when = now;
+    *flow = f;
+    return 1;
+  }
+  fclose(tracefile);
+  tracefile = NULL;
+  return 0;
+}
+
+int traffic_next(int *flow, double now, double *when, int *bytes)
+{
+  *bytes = 20;                           /* one msg */
+  switch (traffic) {
+  case TRAFFIC_POISSON:
+    *when = now + expgap(meangap);
+    break;
+  case TRAFFIC_CBR:
+    *when = now + meangap;
+    break;
+  case TRAFFIC_ONOFF:
+    *when = onoff_next(*flow, now);
+    break;
+  case TRAFFIC_TRACE:
+    return tracefile != NULL && trace_next(flow, now, when, bytes);
+  default:
+    *when = now + meangap*jimsrand()*2;   /* uniform on [0,2*lambda], mean lambda */
+    break;
+  }
+  return 1;
+}
@@ -0,0 +1,20 @@
+/* Layer 5 arrival processes.  spec is one of
+     uniform                      gaps uniform on [0,2*lambda] (the default)
+     poisson                      exponential gaps of mean lambda
+     cbr                          a message every lambda
+     onoff:on_mean,off_mean,alpha Pareto(alpha) ON periods with exponential
+                                  gaps of mean lambda, exponential OFF periods
+     trace:file                   "time size [flow]" lines read as needed
+   returns 0 if it cannot be parsed */
+extern int traffic_configure(const char *spec);
+extern int traffic_trace(void);    /* arrivals come from a trace file */
+
+/* set up the per-flow state once nflows and lambda are known */
+extern void traffic_init(double lambda);
+
+/* The next arrival of *flow after now: its time and size in bytes.  A
+   trace picks the flow itself.  Returns 0 once the trace is exhausted. */
+extern int traffic_next(int *flow, double now, double *when, int *bytes);
+
+/* random number in [0,1], from the emulator */
+extern double jimsrand(void);
@@ -0,0 +1,582 @@
+/* ******************************************************************
+   UDP loopback backend.  Runs the A and B entities of gbn.c or sr.c,
+   unchanged, over two UDP sockets on 127.0.0.1 in place of the emulated
+   network, to measure the protocol as a real transport: messages and
+   packets per second, CPU time per packet and message latency in
+   microseconds.  It is linked instead of emulator.c (Linux only):
+
+     gcc -ansi -Wall -pedantic -o gbn_udp udp.c checksum.c gbn.c
+
+   A and B share one thread and one epoll loop.  Each entity has a socket
+   and a timerfd for its protocol timer; packets tolayer3() hands over are
+   collected and sent with one sendmmsg() per entity and loop turn, and
+   arriving ones are taken in with recvmmsg().  Loss, corruption and an
+   extra one way delay are applied in user space before a packet reaches
+   the socket, the delay through a FIFO and a timerfd per direction.  A is
+   a saturated source: it is handed a message whenever its window has
+   room, until -n messages have been delivered.
+**********************************************************************/
+#define _GNU_SOURCE               /* sendmmsg, recvmmsg */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "emulator.h"
+#include "gbn.h"
+#include "checksum.h"
+
+int TRACE = 0;
+int nflows = 1;
+THREADLOCAL int current_flow = 0;
+
+/* statistics updated by the protocol */
+THREADLOCAL int window_full;
+THREADLOCAL int total_ACKs_received;
+THREADLOCAL int packets_resent;
+THREADLOCAL int new_ACKs;
+THREADLOCAL int packets_received;
+
+#define MAXBATCH 256
+#define MAXDELAYED 65536          /* packets held by the delay, per direction */
+#define MAXTAKEN 4096             /* messages in A's window, for their latency */
+
+/* epoll tags */
+#define SOCKET  0
+#define TIMER   2
+#define DELAY   4
+
+static int nmsgs = 100000;        /* messages to deliver */
+static double lossprob = 0.0;
+static double corruptprob = 0.0;
+static double delayus = 0.0;      /* extra one way delay in microseconds */
+static double timeunit = 10.0;    /* microseconds per protocol time unit */
+static int batch = 32;            /* most packets per sendmmsg/recvmmsg */
+
+static int epfd;
+static int sock[2];               /* A's and B's socket, connected to each other */
+static int timerfd[2];            /* protocol timers of A and B */
+static int armed[2];
+static int delayfd[2];            /* releases packets held back, per sender */
+
+/* packets waiting for the next sendmmsg, per sender */
+static struct pkt outgoing[2][MAXBATCH];
+static int noutgoing[2];
+
+/* packets held back by the delay, per sender, in send order */
+static struct delayed {
+  double due;
+  struct pkt packet;
+} *delayed[2];
+static int firstdelayed[2], ndelayed[2];
+
+/* times A took the messages not yet delivered */
+static double taken[MAXTAKEN];
+static int firsttaken = 0, ntaken = 0;
+
+static int generated = 0, delivered = 0;
+static long packets_sent = 0, packets_lost = 0, packets_corrupt = 0, packets_arrived = 0;
+static long sendcalls = 0, recvcalls = 0, timeouts = 0;
+static double latencysum = 0.0, latencymax = 0.0, lastdelivery;
+
+/* random number in [0,1], as the emulator draws them */
+double jimsrand(void)
+{
+  return rand() / (double)RAND_MAX;
+}
+
+/* monotonic wall clock in microseconds */
+double now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* the clock in protocol time units, for the protocol */
+double get_sim_time(void)
+{
+  return now() / timeunit;
+}
+
+void settimer(int fd, double us)
+{
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  if (us > 0.0) {
+    if (us < 1.0)
+      us = 1.0;     /* zero would disarm it */
+    its.it_value.tv_sec = (time_t)(us / 1e6);
+    its.it_value.tv_nsec = (long)((us - its.it_value.tv_sec * 1e6) * 1e3);
+  }
+  if (timerfd_settime(fd, 0, &its, NULL) != 0) {
+    printf("cannot set a timer.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* send the packets collected for sender with as few sendmmsg calls as
+   the socket takes; what it does not take is lost, like a full queue */
+void flush(int sender)
+{
+  struct mmsghdr msgs[MAXBATCH];
+  struct iovec iov[MAXBATCH];
+  int i, sent = 0, n;
+
+  if (noutgoing[sender] == 0)
+    return;
+  memset(msgs, 0, noutgoing[sender] * sizeof(struct mmsghdr));
+  for (i=0; i<noutgoing[sender]; i++) {
+    iov[i].iov_base = &outgoing[sender][i];
+    iov[i].iov_len = sizeof(struct pkt);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  while (sent < noutgoing[sender]) {
+    n = sendmmsg(sock[sender], msgs + sent, noutgoing[sender] - sent, 0);
+    sendcalls++;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != ENOBUFS) {
+        perror("sendmmsg");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    }
+    sent += n;
+  }
+  packets_sent += noutgoing[sender];
+  noutgoing[sender] = 0;
+}
+
+void queue(int sender, struct pkt *packet)
+{
+  if (noutgoing[sender] == batch)
+    flush(sender);
+  outgoing[sender][noutgoing[sender]++] = *packet;
+}
+
+/* packets whose delay is over go out */
+void release(int sender)
+{
+  struct delayed *d;
+  double t = now();
+  unsigned char ticks[8];
+
+  if (read(delayfd[sender], ticks, sizeof(ticks)) < 0 && errno != EAGAIN) {
+    perror("read");
+    exit(EXIT_FAILURE);
+  }
+  while (ndelayed[sender] > 0) {
+    d = &delayed[sender][firstdelayed[sender]];
+    if (d->due > t) {
+      settimer(delayfd[sender], d->due - t);
+      return;
+    }
+    queue(sender, &d->packet);
+    firstdelayed[sender] = (firstdelayed[sender] + 1) % MAXDELAYED;
+    ndelayed[sender]--;
+  }
+}
+
+/* the emulator's interface to the protocol */
+void tolayer3(int AorB, struct pkt packet)
+{
+  struct delayed *d;
+  double x;
+
+  if (TRACE>2)
+    printf("          TOLAYER3: seq: %d, ack %d, check: %d\n", packet.seqnum, packet.acknum, packet.checksum);
+  if (jimsrand() < lossprob) {
+    packets_lost++;
+    packets_sent++;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being lost\n");
+    return;
+  }
+  if (jimsrand() < corruptprob) {
+    packets_corrupt++;
+    if ((x = jimsrand()) < .75)
+      packet.payload[0] = 'Z';
+    else if (x < .875)
+      packet.seqnum = 999999;
+    else
+      packet.acknum = 999999;
+    if (TRACE>0)
+      printf("          TOLAYER3: packet being corrupted\n");
+  }
+  if (delayus <= 0.0) {
+    queue(AorB, &packet);
+    return;
+  }
+  if (ndelayed[AorB] == MAXDELAYED) {
+    packets_lost++;     /* the delay line is full */
+    packets_sent++;
+    return;
+  }
+  d = &delayed[AorB][(firstdelayed[AorB] + ndelayed[AorB]) % MAXDELAYED];
+  d->due = now() + delayus;
+  d->packet = packet;
+  if (ndelayed[AorB]++ == 0)
+    settimer(delayfd[AorB], delayus);
+}
+
+void tolayer5(int AorB, char datasent[20])
+{
+  double t, latency;
+  int i;
+
+  if (TRACE>2) {
+    printf("          TOLAYER5: data received by application at %c: ", AorB == A ? 'A' : 'B');
+    for (i=0; i<20; i++)
+      printf("%c", datasent[i]);
+    printf("\n");
+  }
+  if (AorB != B)
+    return;
+  delivered++;
+  t = lastdelivery = now();
+  if (ntaken > 0) {
+    latency = t - taken[firsttaken];
+    latencysum += latency;
+    if (latency > latencymax)
+      latencymax = latency;
+    firsttaken = (firsttaken + 1) % MAXTAKEN;
+    ntaken--;
+  }
+}
+
+void tolayer5v(int AorB, const struct msgspan *spans, int nspans)
+{
+  int i, k;
+
+  for (i=0; i<nspans; i++)
+    for (k=0; k<spans[i].count; k++)
+      tolayer5(AorB, (char *)spans[i].base + k * spans[i].stride);
+}
+
+/* the application takes every message at once */
+int tolayer5_room(int AorB)
+{
+  return INT_MAX;
+}
+
+/* A is a saturated source, backlogged until it has handed out nmsgs */
+int layer5_waiting(int AorB)
+{
+  return AorB == A && generated < nmsgs;
+}
+
+void starttimer(int AorB, double increment)
+{
+  if (TRACE>1)
+    printf("          START TIMER: starting timer\n");
+  if (armed[AorB]) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
+  }
+  armed[AorB] = 1;
+  settimer(timerfd[AorB], increment * timeunit);
+}
+
+void stoptimer(int AorB)
+{
+  if (TRACE>1)
+    printf("          STOP TIMER: stopping timer\n");
+  if (!armed[AorB]) {
+    printf("Warning: unable to cancel your timer. It wasn't running.\n");
+    return;
+  }
+  armed[AorB] = 0;
+  settimer(timerfd[AorB], 0.0);
+}
+
+/* take in what arrived at entity AorB, batch by batch */
+void receive(int AorB)
+{
+  struct mmsghdr msgs[MAXBATCH];
+  struct iovec iov[MAXBATCH];
+  struct pkt packets[MAXBATCH];
+  int i, n;
+
+  for (;;) {
+    memset(msgs, 0, batch * sizeof(struct mmsghdr));
+    for (i=0; i<batch; i++) {
+      iov[i].iov_base = &packets[i];
+      iov[i].iov_len = sizeof(struct pkt);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    n = recvmmsg(sock[AorB], msgs, batch, MSG_DONTWAIT, NULL);
+    recvcalls++;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN) {
+        perror("recvmmsg");
+        exit(EXIT_FAILURE);
+      }
+      return;
+    }
+    for (i=0; i<n; i++) {
+      if (msgs[i].msg_len != sizeof(struct pkt))
+        continue;
+      packets_arrived++;
+      if (AorB == A)
+        A_input(packets[i]);
+      else
+        B_input(packets[i]);
+    }
+    if (n < batch)
+      return;
+  }
+}
+
+void timerinterrupt(int AorB)
+{
+  unsigned char ticks[8];
+
+  if (read(timerfd[AorB], ticks, sizeof(ticks)) < 0) {
+    if (errno == EAGAIN)
+      return;       /* stopped after it fired */
+    perror("read");
+    exit(EXIT_FAILURE);
+  }
+  if (!armed[AorB])
+    return;
+  armed[AorB] = 0;
+  timeouts++;
+  if (AorB == A)
+    A_timerinterrupt();
+  else
+    B_timerinterrupt();
+}
+
+/* A takes messages for as long as its window has room */
+void feed(void)
+{
+  struct msg msg2give;
+  int i;
+
+  while (generated < nmsgs && A_ready()) {
+    if (ntaken == MAXTAKEN) {
+      printf("more than %d messages in the window.\n", MAXTAKEN);
+      exit(EXIT_FAILURE);
+    }
+    for (i=0; i<20; i++)
+      msg2give.data[i] = 97 + generated % 26;
+    generated++;
+    taken[(firsttaken + ntaken++) % MAXTAKEN] = now();
+    A_output(msg2give);
+  }
+}
+
+void watch(int fd, unsigned int tag)
+{
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = tag;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void setup(void)
+{
+  struct sockaddr_in addr[2];
+  socklen_t len;
+  int e, size = 4 << 20;
+
+  epfd = epoll_create1(0);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  for (e=A; e<=B; e++) {
+    sock[e] = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sock[e] < 0) {
+      perror("socket");
+      exit(EXIT_FAILURE);
+    }
+    setsockopt(sock[e], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sock[e], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    memset(&addr[e], 0, sizeof(addr[e]));
+    addr[e].sin_family = AF_INET;
+    addr[e].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    len = sizeof(addr[e]);
+    if (bind(sock[e], (struct sockaddr *)&addr[e], sizeof(addr[e])) != 0 ||
+        getsockname(sock[e], (struct sockaddr *)&addr[e], &len) != 0) {
+      perror("bind");
+      exit(EXIT_FAILURE);
+    }
+    timerfd[e] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    delayfd[e] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timerfd[e] < 0 || delayfd[e] < 0) {
+      perror("timerfd_create");
+      exit(EXIT_FAILURE);
+    }
+    watch(sock[e], SOCKET + e);
+    watch(timerfd[e], TIMER + e);
+    watch(delayfd[e], DELAY + e);
+    if (delayus > 0.0) {
+      delayed[e] = malloc(MAXDELAYED * sizeof(struct delayed));
+      if (delayed[e] == 0) {
+        printf("memory allocation for the delay failed.");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  for (e=A; e<=B; e++)
+    if (connect(sock[e], (struct sockaddr *)&addr[1 - e], sizeof(addr[1 - e])) != 0) {
+      perror("connect");
+      exit(EXIT_FAILURE);
+    }
+}
+
+double cputime(void)
+{
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+void usage(void)
+{
+  printf("usage: udp [options]\n");
+  printf("  -n messages                 messages to deliver (default 100000)\n");
+  printf("  -loss p, -corrupt p         packet loss and corruption probability\n");
+  printf("  -delay us                   extra one way delay in microseconds\n");
+  printf("  -timeunit us                microseconds per protocol time unit (default 10)\n");
+  printf("  -batch n                    most packets per sendmmsg/recvmmsg (default 32)\n");
+  printf("  -checksum sum|inet|crc32c   checksum used by the protocol (default sum)\n");
+  printf("  -trace n                    TRACE level of the protocol (default 0)\n");
+  exit(EXIT_FAILURE);
+}
+
+void parseargs(int argc, char **argv)
+{
+  int i;
+
+  for (i=1; i<argc; i++) {
+    if (i+1 == argc)
+      usage();
+    if (strcmp(argv[i], "-n") == 0) {
+      if (sscanf(argv[++i], "%d", &nmsgs) != 1 || nmsgs < 1)
+        usage();
+    }
+    else if (strcmp(argv[i], "-loss") == 0) {
+      if (sscanf(argv[++i], "%lf", &lossprob) != 1 || lossprob < 0.0 || lossprob >= 1.0)
+        usage();
+    }
+    else if (strcmp(argv[i], "-corrupt") == 0) {
+      if (sscanf(argv[++i], "%lf", &corruptprob) != 1 || corruptprob < 0.0 || corruptprob >= 1.0)
+        usage();
+    }
+    else if (strcmp(argv[i], "-delay") == 0) {
+      if (sscanf(argv[++i], "%lf", &delayus) != 1 || delayus < 0.0)
+        usage();
+    }
+    else if (strcmp(argv[i], "-timeunit") == 0) {
+      if (sscanf(argv[++i], "%lf", &timeunit) != 1 || timeunit <= 0.0)
+        usage();
+    }
+    else if (strcmp(argv[i], "-batch") == 0) {
+      if (sscanf(argv[++i], "%d", &batch) != 1 || batch < 1 || batch > MAXBATCH)
+        usage();
+    }
+    else if (strcmp(argv[i], "-checksum") == 0) {
+      if (!checksum_select(argv[++i]))
+        usage();
+    }
+    else if (strcmp(argv[i], "-trace") == 0) {
+      if (sscanf(argv[++i], "%d", &TRACE) != 1)
+        usage();
+    }
+    else
+      usage();
+  }
+}
+
+int main(int argc, char **argv)
+{
+  struct epoll_event evs[8];
+  double start, cpustart, elapsed, cpu;
+  long packets;
+  int i, n, e;
+
+  parseargs(argc, argv);
+  srand(9999);
+  checksum_init();
+  setup();
+  A_init();
+  B_init();
+
+  start = lastdelivery = now();
+  cpustart = cputime();
+  while (delivered < nmsgs) {
+    feed();
+    flush(A);
+    flush(B);
+    n = epoll_wait(epfd, evs, 8, 1000);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+    for (i=0; i<n; i++) {
+      e = evs[i].data.u32 % 2;
+      switch (evs[i].data.u32 - e) {
+      case SOCKET:
+        receive(e);
+        break;
+      case TIMER:
+        timerinterrupt(e);
+        break;
+      case DELAY:
+        release(e);
+        break;
+      }
+    }
+    if (now() - lastdelivery > 5e6) {
+      printf("stalled: nothing delivered for 5 seconds\n");
+      break;
+    }
+  }
+  elapsed = now() - start;
+  cpu = cputime() - cpustart;
+
+  packets = packets_sent > 0 ? packets_sent : 1;
+  printf("UDP loopback: %d of %d messages delivered in %.3f s\n", delivered, nmsgs, elapsed / 1e6);
+  printf("  throughput:  %.0f messages/s, %.0f packets/s (data and ACKs)\n",
+         delivered / (elapsed / 1e6), packets_sent / (elapsed / 1e6));
+  printf("  CPU time:  %.3f s, %.2f us per packet sent\n", cpu / 1e6, cpu / packets);
+  printf("  message latency:  mean %.1f us, max %.1f us\n",
+         delivered ? latencysum / delivered : 0.0, latencymax);
+  printf("  packets sent %ld, lost %ld, corrupted %ld, in flight at the end or lost by the sockets %ld\n", packets_sent,
+         packets_lost, packets_corrupt, packets_sent - packets_lost - packets_arrived);
+  printf("  packet resends by A %d, timeouts %ld, messages dropped due to full window %d\n",
+         packets_resent, timeouts, window_full);
+  printf("  sendmmsg calls %ld (%.1f packets each), recvmmsg calls %ld (%.1f packets each)\n",
+         sendcalls, sendcalls ? (double)(packets_sent - packets_lost) / sendcalls : 0.0,
+         recvcalls, recvcalls ? (double)packets_arrived / recvcalls : 0.0);
+#ifdef AUTOWINDOW
+  printf("  window of A at the end:  %d\n", A_window());
+#endif
+  return EXIT_SUCCESS;
+}